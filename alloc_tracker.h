@@ -0,0 +1,162 @@
+#ifndef ALLOC_TRACKER_H
+#define ALLOC_TRACKER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <CL/cl.h>  // Include OpenCL header file
+
+#ifndef ALLOC_TRACE
+#define ALLOC_TRACE 0 // Macro for per-allocation trace control
+#endif
+
+#ifndef ALLOC_COUNT_NEW
+#define ALLOC_COUNT_NEW 0 // Macro for counting operator new calls, define as 1 in exactly one translation unit
+#endif
+
+#define ALLOC_HEADER 16 // Bytes stored in front of each host block, keeps 16-byte alignment
+
+#ifndef RECLAIM_MIN_BYTES
+#define RECLAIM_MIN_BYTES (16 * 1024 * 1024) // Host blocks and device buffers at least this large are released on the reclaim thread
+#endif
+
+bool reclaim_free_block(void *block); // Function declaration for queueing a block for free() on the program's reclaim thread
+
+// Allocation statistics for one memory space (host or device)
+struct alloc_stats {
+    size_t current;  // Bytes currently allocated
+    size_t peak;     // Highest value current has reached
+    size_t count;    // Number of allocations made
+    size_t total;    // Sum of all allocation sizes
+    size_t largest;  // Largest single allocation
+};
+
+static alloc_stats host_alloc_stats = {0, 0, 0, 0, 0};   // Statistics for tracked host memory
+static alloc_stats device_alloc_stats = {0, 0, 0, 0, 0}; // Statistics for tracked device buffers
+static size_t new_alloc_count = 0; // Number of operator new calls, counted when ALLOC_COUNT_NEW is set
+
+#if ALLOC_COUNT_NEW
+#include <new>
+
+// Counting allocator hook: replaces the global operator new, so containers and threads are counted too
+void *operator new(size_t bytes) {
+    new_alloc_count++;
+    void *ptr = malloc(bytes ? bytes : 1);
+    if (ptr == NULL) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+#endif
+
+// Function definition for recording an allocation
+static inline void record_alloc(alloc_stats &stats, const char *space, size_t bytes) {
+    stats.current += bytes;
+    stats.count++;
+    stats.total += bytes;
+    if (stats.current > stats.peak) {
+        stats.peak = stats.current;
+    }
+    if (bytes > stats.largest) {
+        stats.largest = bytes;
+    }
+    if (ALLOC_TRACE) {
+        printf("[alloc] %s +%zu bytes (current %zu, peak %zu)\n", space, bytes, stats.current, stats.peak);
+    }
+}
+
+// Function definition for recording a release
+static inline void record_free(alloc_stats &stats, const char *space, size_t bytes) {
+    stats.current -= bytes;
+    if (ALLOC_TRACE) {
+        printf("[alloc] %s -%zu bytes (current %zu)\n", space, bytes, stats.current);
+    }
+}
+
+// Function definition for allocating tracked host memory
+static inline void *tracked_malloc(size_t bytes) {
+    char *block = (char *)malloc(bytes + ALLOC_HEADER); // Room for the size in front of the block
+    if (block == NULL) {
+        return NULL;
+    }
+    *(size_t *)block = bytes;
+    record_alloc(host_alloc_stats, "host", bytes);
+    return block + ALLOC_HEADER;
+}
+
+// Function definition for freeing tracked host memory
+static inline void tracked_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    char *block = (char *)ptr - ALLOC_HEADER;
+    record_free(host_alloc_stats, "host", *(size_t *)block);
+    free(block);
+}
+
+// Function definition for freeing tracked host memory. The statistics are updated here, so only the caller's
+// thread touches them; blocks of RECLAIM_MIN_BYTES or more are then unmapped on the reclaim thread, or in place
+// when reclaim_free_block() cannot take them.
+static inline void deferred_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    char *block = (char *)ptr - ALLOC_HEADER;
+    size_t bytes = *(size_t *)block;
+    if (bytes < RECLAIM_MIN_BYTES) {
+        tracked_free(ptr);
+        return;
+    }
+    record_free(host_alloc_stats, "host", bytes);
+    if (!reclaim_free_block(block)) {
+        free(block);
+    }
+}
+
+// Function definition for creating a tracked OpenCL buffer
+static inline cl_mem tracked_clCreateBuffer(cl_context ctx, cl_mem_flags flags, size_t bytes, void *host_ptr, cl_int *errcode) {
+    cl_int err;
+    cl_mem buf = clCreateBuffer(ctx, flags, bytes, host_ptr, &err);
+    if (errcode != NULL) {
+        *errcode = err;
+    }
+    if (err == CL_SUCCESS) {
+        record_alloc(device_alloc_stats, "device", bytes);
+    }
+    return buf;
+}
+
+// Function definition for releasing a tracked OpenCL buffer
+static inline cl_int tracked_clReleaseMemObject(cl_mem buf) {
+    size_t bytes = 0;
+    if (clGetMemObjectInfo(buf, CL_MEM_SIZE, sizeof(bytes), &bytes, NULL) == CL_SUCCESS) {
+        record_free(device_alloc_stats, "device", bytes);
+    }
+    return clReleaseMemObject(buf);
+}
+
+// Function definition for counting all allocations so far: tracked host memory, device buffers and operator new
+static inline size_t total_alloc_count() {
+    return host_alloc_stats.count + device_alloc_stats.count + new_alloc_count;
+}
+
+// Function definition for printing the allocation summary, registered with atexit()
+static inline void print_alloc_summary() {
+    const alloc_stats *stats[2] = {&host_alloc_stats, &device_alloc_stats};
+    const char *names[2] = {"Host", "Device"};
+
+    for (int i = 0; i < 2; i++) {
+        printf("%s memory: peak %.2f MB, current %zu bytes, %zu allocations, %.2f MB total, largest %.2f MB\n",
+               names[i], stats[i]->peak / 1048576.0, stats[i]->current, stats[i]->count,
+               stats[i]->total / 1048576.0, stats[i]->largest / 1048576.0);
+    }
+}
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef DEVICE_RANKING_H
+#define DEVICE_RANKING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <CL/cl.h>  // Include OpenCL header file
+#include "alloc_tracker.h" // Include host allocation tracking
+
+#ifndef DEVICE_RANKING
+#define DEVICE_RANKING 1 // Macro for benchmark-driven device selection control
+#endif
+
+#define DEVICE_RANK_FILE "./ocl_device_rank.cache" // File caching the probe results
+#define MAX_RANKED_DEVICES 16                      // Maximum number of devices probed
+#define PROBE_BYTES (16 * 1024 * 1024)             // Transfer size of the bandwidth probe
+#define PROBE_LAUNCHES 20                          // Kernel launches averaged by the latency probe
+
+// Probe results for one platform/device pair
+struct device_rank {
+    cl_device_id id;          // OpenCL device id
+    char platform_name[128];  // Platform name, part of the cache key
+    char device_name[128];    // Device name, part of the cache key
+    double latency_us;        // Average time for an empty kernel launch to complete
+    double bandwidth_gbps;    // Host-device transfer bandwidth (write then read)
+};
+
+static device_rank ranked_devices[MAX_RANKED_DEVICES]; // Every device found on every platform
+static int num_ranked_devices = 0;                     // Number of entries in ranked_devices
+
+static const char *probe_kernel_source = "__kernel void probe_noop(__global int *p) { if (p[0] < 0) p[0] = 0; }\n";
+
+// Function definition for measuring launch latency and transfer bandwidth of one device
+static inline bool probe_device(device_rank &d) {
+    cl_int err;
+    cl_context ctx = clCreateContext(NULL, 1, &d.id, NULL, NULL, &err);
+    if (err < 0) {
+        return false;
+    }
+    cl_command_queue q = clCreateCommandQueueWithProperties(ctx, d.id, 0, &err);
+    if (err < 0) {
+        clReleaseContext(ctx);
+        return false;
+    }
+    cl_program prog = clCreateProgramWithSource(ctx, 1, &probe_kernel_source, NULL, &err);
+    bool ok = err == CL_SUCCESS && clBuildProgram(prog, 1, &d.id, NULL, NULL, NULL) == CL_SUCCESS;
+    cl_kernel k = ok ? clCreateKernel(prog, "probe_noop", &err) : NULL;
+    cl_mem buf = clCreateBuffer(ctx, CL_MEM_READ_WRITE, PROBE_BYTES, NULL, &err);
+    char *host = (char *)tracked_malloc(PROBE_BYTES);
+    ok = ok && k != NULL && err == CL_SUCCESS && host != NULL;
+
+    if (ok) {
+        memset(host, 1, PROBE_BYTES);
+        size_t one = 1;
+        clSetKernelArg(k, 0, sizeof(cl_mem), &buf);
+        clEnqueueNDRangeKernel(q, k, 1, NULL, &one, NULL, 0, NULL, NULL); // Warm-up launch
+        clFinish(q);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < PROBE_LAUNCHES; i++) {
+            clEnqueueNDRangeKernel(q, k, 1, NULL, &one, NULL, 0, NULL, NULL);
+            clFinish(q); // Each launch waits, so this measures launch-to-completion latency
+        }
+        std::chrono::duration<double, std::micro> launch_time = std::chrono::high_resolution_clock::now() - start;
+        d.latency_us = launch_time.count() / PROBE_LAUNCHES;
+
+        double best_ms = -1;
+        for (int rep = 0; rep < 3; rep++) {
+            start = std::chrono::high_resolution_clock::now();
+            clEnqueueWriteBuffer(q, buf, CL_TRUE, 0, PROBE_BYTES, host, 0, NULL, NULL);
+            clEnqueueReadBuffer(q, buf, CL_TRUE, 0, PROBE_BYTES, host, 0, NULL, NULL);
+            std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - start;
+            if (best_ms < 0 || t.count() < best_ms) {
+                best_ms = t.count();
+            }
+        }
+        d.bandwidth_gbps = 2.0 * PROBE_BYTES / (best_ms * 1e6);
+    }
+
+    tracked_free(host);
+    if (buf != NULL) clReleaseMemObject(buf);
+    if (k != NULL) clReleaseKernel(k);
+    if (prog != NULL) clReleaseProgram(prog);
+    if (q != NULL) clReleaseCommandQueue(q);
+    clReleaseContext(ctx);
+    return ok;
+}
+
+// Function definition for filling ranking entries with cached results, returns false if any device is missing.
+// Identical devices share a platform and device name, so each cache line fills the first entry not yet filled.
+static inline bool load_device_ranking() {
+    FILE *cache = fopen(DEVICE_RANK_FILE, "r");
+    if (cache == NULL) {
+        return false;
+    }
+    char line[512];
+    bool loaded[MAX_RANKED_DEVICES] = {false};
+    int found = 0;
+    while (fgets(line, sizeof(line), cache) != NULL) {
+        char *platform = strtok(line, "\t");
+        char *device = strtok(NULL, "\t");
+        char *latency = strtok(NULL, "\t");
+        char *bandwidth = strtok(NULL, "\t\n");
+        if (platform == NULL || device == NULL || latency == NULL || bandwidth == NULL) {
+            continue;
+        }
+        for (int i = 0; i < num_ranked_devices; i++) {
+            if (!loaded[i] && strcmp(ranked_devices[i].platform_name, platform) == 0 &&
+                strcmp(ranked_devices[i].device_name, device) == 0) {
+                loaded[i] = true;
+                ranked_devices[i].latency_us = atof(latency);
+                ranked_devices[i].bandwidth_gbps = atof(bandwidth);
+                found++;
+                break;
+            }
+        }
+    }
+    fclose(cache);
+    return found == num_ranked_devices; // A new or changed device invalidates the cache
+}
+
+// Function definition for writing the probe results to the cache file
+static inline void save_device_ranking() {
+    FILE *cache = fopen(DEVICE_RANK_FILE, "w");
+    if (cache == NULL) {
+        return;
+    }
+    for (int i = 0; i < num_ranked_devices; i++) {
+        fprintf(cache, "%s\t%s\t%f\t%f\n", ranked_devices[i].platform_name, ranked_devices[i].device_name,
+                ranked_devices[i].latency_us, ranked_devices[i].bandwidth_gbps);
+    }
+    fclose(cache);
+}
+
+// Function definition for enumerating every platform/device pair and ranking them, probing only on a cache miss
+static inline void rank_devices() {
+    cl_platform_id platforms[8];
+    cl_uint num_platforms = 0;
+    num_ranked_devices = 0;
+    if (clGetPlatformIDs(8, platforms, &num_platforms) < 0) {
+        return;
+    }
+
+    for (cl_uint p = 0; p < num_platforms && p < 8; p++) {
+        char platform_name[128] = "";
+        cl_device_id devices[MAX_RANKED_DEVICES];
+        cl_uint num_devices = 0;
+        clGetPlatformInfo(platforms[p], CL_PLATFORM_NAME, sizeof(platform_name), platform_name, NULL);
+        if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, MAX_RANKED_DEVICES, devices, &num_devices) < 0) {
+            continue;
+        }
+        for (cl_uint i = 0; i < num_devices && num_ranked_devices < MAX_RANKED_DEVICES; i++) {
+            device_rank &d = ranked_devices[num_ranked_devices++];
+            d.id = devices[i];
+            strcpy(d.platform_name, platform_name);
+            clGetDeviceInfo(devices[i], CL_DEVICE_NAME, sizeof(d.device_name), d.device_name, NULL);
+            d.latency_us = -1;
+            d.bandwidth_gbps = -1;
+        }
+    }
+
+    if (!load_device_ranking()) {
+        for (int i = 0; i < num_ranked_devices; i++) {
+            if (!probe_device(ranked_devices[i])) {
+                ranked_devices[i].latency_us = -1; // Device failed to run the probe, never pick it
+            }
+        }
+        save_device_ranking();
+    }
+}
+
+// Function definition for estimating how long an op moving the given bytes takes on a device
+static inline double estimate_op_us(const device_rank &d, size_t bytes) {
+    return d.latency_us + bytes / (d.bandwidth_gbps * 1e3);
+}
+
+// Function definition for picking the fastest ranked device for an op, or NULL if none could be probed. Data
+// already resident on the current device has to be uploaded again to any other device, which counts against it.
+static inline cl_device_id select_device_for_op(size_t bytes, cl_device_id current, size_t resident_bytes) {
+    int best = -1;
+    double best_us = 0;
+    for (int i = 0; i < num_ranked_devices; i++) {
+        if (ranked_devices[i].latency_us < 0 || ranked_devices[i].bandwidth_gbps <= 0) {
+            continue;
+        }
+        double us = estimate_op_us(ranked_devices[i], ranked_devices[i].id == current ? bytes : bytes + resident_bytes);
+        if (best < 0 || us < best_us) {
+            best = i;
+            best_us = us;
+        }
+    }
+    if (best < 0) {
+        return NULL;
+    }
+    printf("Selected %s / %s (%.1f us launch, %.2f GB/s)\n", ranked_devices[best].platform_name,
+           ranked_devices[best].device_name, ranked_devices[best].latency_us, ranked_devices[best].bandwidth_gbps);
+    return ranked_devices[best].id;
+}
+
+#endif
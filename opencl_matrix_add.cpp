@@ -1,78 +1,681 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <CL/cl.h>  // Include OpenCL header file
 #include <chrono>   // Include chrono for time measurements
+#include <thread>   // Include thread for parallel host fallbacks and the reclaim thread
+#include <mutex>    // Include mutex for the reclaim queue
+#include <condition_variable> // Include condition_variable for waking the reclaim thread
+#include <type_traits> // Include type_traits for unsigned key types in the host radix sort
+#include <math.h>   // Include math for matrix shapes and error measurements
+#include <float.h>  // Include float for the smallest normal float in the host math polynomials
+#include <stdint.h> // Include stdint for pointer alignment checks
+#include <unistd.h> // Include unistd for querying cache sizes
+#include <sys/stat.h> // Include stat for checking program binary cache freshness
+#if defined(__SSE2__)
+#include <immintrin.h> // Include SSE2 intrinsics for streaming stores
+#endif
+#ifndef ALLOC_COUNT_NEW
+#define ALLOC_COUNT_NEW 1 // Count operator new calls too, for the steady-state allocation check
+#endif
+#include "alloc_tracker.h" // Include host and device allocation tracking
+#include "perf_counters.h" // Include hardware counters for host phases
+#include "device_ranking.h" // Include benchmark-driven device selection
 
 #define PRINT 1     // Macro for print control
+#define NT_STORE_THRESHOLD (8 * 1024 * 1024) // Fallback output size in bytes above which streaming stores are used
+#define L2_CACHE_SIZE (1024 * 1024)          // Fallback L2 cache size in bytes for host tiling
+#define CACHE_LINE_INTS 16                   // Number of ints in a 64-byte cache line
+#ifndef FAST_START
+#define FAST_START 0 // Macro for fast start mode: cached device and program binary, lazy host calibration
+#endif
+#ifndef FAST_EXIT
+#define FAST_EXIT 0 // Macro for fast exit mode: skip the teardown the OS does anyway when the process ends
+#endif
+#ifndef DEVICE_BUDGET_MB
+#define DEVICE_BUDGET_MB 0 // Macro for capping the device memory budget in MB, 0 plans with CL_DEVICE_GLOBAL_MEM_SIZE
+#endif
+#define DEVICE_CACHE_FILE "./ocl_device.cache" // File remembering the selected device type
+#define MAX_STARTUP_PHASES 12                  // Number of startup phases timed
+#ifndef NUM_QUEUES
+#define NUM_QUEUES 4                // Number of command queues in the per-device pool
+#endif
+#define QUEUE_ROUND_ROBIN 0         // Queue assignment policy: rotate through the pool
+#define QUEUE_LEAST_LOADED 1        // Queue assignment policy: pick the queue with the least pending work
+#ifndef QUEUE_POLICY
+#define QUEUE_POLICY QUEUE_LEAST_LOADED // Macro for queue assignment policy control
+#endif
+#define MIN_SPLIT_ITEMS (1 << 20)   // NDRanges smaller than this run on a single queue
+#ifndef QUEUE_BENCHMARK
+#define QUEUE_BENCHMARK 0           // Macro for timing the kernel with 1..NUM_QUEUES queues
+#endif
+#define MAX_KERNELS 32              // Number of kernels the vector op cache can hold
+#define OP_LOCAL_SIZE 256           // Work-group size used by the vector ops
+#define COLLISION_SAMPLE 65536      // Indices sampled to estimate the scatter-add collision rate
+#define SORT_COLLISION_RATE 0.5     // Collision rate above which scatter-add sorts instead of using global atomics
+#define SEG_CHUNK 64                // Sorted elements per work-item in segmented_reduce_ocl, passed to the program as -D
+#define LARGE_SCATTER_BINS (1 << 20) // Output size of the scatter-add checks that are too large for local memory
+#define DENSE_SCATTER_BINS 1024     // Bins hit by the high-collision scatter-add check
+#define RADIX_BITS 4                // Key bits per device radix sort pass, matches vector_ops_ocl.cl
+#define RADIX_BUCKETS (1 << RADIX_BITS) // Digit values per device radix sort pass
+#define RADIX_ITEMS 256             // Keys per work-item in the device radix sort, matches vector_ops_ocl.cl
+#define HOST_RADIX_BITS 8           // Key bits per host radix sort pass
+#define TOPK_MAX (OP_LOCAL_SIZE / 2) // Largest k for topk_ocl, so each round shrinks the candidates by at least 4
+#define CODEC_CHUNK 1024            // Values per frame-of-reference chunk, matches vector_ops_ocl.cl
+#define CODEC_MAX_RATIO 0.75        // Packed inputs must be at most this fraction of the raw size to be worth decoding
+#define MATRIX_TILE 16              // Work-group edge for 2D matrix kernels
+#define GEMM_TILE 16                // Work-group edge of gemm_int8_ocl, matches vector_ops_ocl.cl
+#define GEMM_BLOCK_N 64             // Rows of B kept in cache together by the host int8 GEMM
+#define GEMM_DIM 1024               // M, N and K used by the gemm_int8 op
+#define GEMV_ROWS 4                 // Rows per work-group of gemv_rows_ocl, matches vector_ops_ocl.cl
+#define STENCIL_FILE "./stencil_ocl.cl" // Kernel source built once per stencil radius, coefficients and vector width
+#define STENCIL_MAX_RADIUS 64       // Largest stencil radius, also the largest one benchmarked
+#define STENCIL_CACHE 8             // Built stencil kernels kept, the oldest is replaced first
+#define STENCIL_CHECK (1 << 19)     // Outputs at each end of the signal checked against the host
+#define MATH_PROBE (1 << 20)        // Inputs used to measure the error and speed of each math tier
+#define MAX_KERNEL_ARGS 12          // Arguments per kernel remembered by set_kernel_arg()
+#define KERNEL_ARG_BYTES 16         // Largest argument value remembered, larger ones are always set
+#define MAX_ARG_KERNELS (MAX_KERNELS + STENCIL_CACHE + 1) // Kernels whose arguments are remembered
+#define STEADY_REPS 100             // Adds run by the steady-state allocation check
+#define BENCH_REPS 5                // Timed repetitions per kernel in the bandwidth benchmarks, best one kept
+#define RECLAIM_QUEUE 64            // Releases the reclaim thread can have pending, further ones are made in place
+#define DEVICE_BUDGET_FRACTION 0.9  // Fraction of CL_DEVICE_GLOBAL_MEM_SIZE the memory manager fills before evicting
+#define MAX_MANAGED 64              // Host vectors the device memory manager can track
+#define SPILL_VECTORS 8             // Vectors cycled through the device by the spill op
+#define SPILL_ROUNDS 2              // Passes over the vectors made by the spill op
+#define CU_WORK_ITEMS 2048          // Resident work-items per compute unit assumed by the occupancy estimate, OpenCL does not report it
+#define CU_PRIVATE_BYTES (256 * 1024) // Private memory (register file) per compute unit assumed by the occupancy estimate
+#define CU_LOCAL_BYTES (64 * 1024)  // Local memory per compute unit assumed by the occupancy estimate, OpenCL only reports the per-work-group limit
+#define MIN_OCCUPANCY 0.25          // Estimated occupancy below which a local size is pruned from the candidates
+#define MIN_LOCAL_SIZE 32           // Smallest local size tried by the occupancy op
+
+// Storage types for float vectors and matrices; compute is always fp32
+enum storage_type { STORAGE_F32, STORAGE_F16, STORAGE_BF16 };
+const char *storage_names[] = {"f32", "f16", "bf16"}; // Kernel name suffixes for each storage type
+
+// Host-device traffic of an op, in vectors of SZ ints. Only the transfer-bound ops are listed: the device ranking
+// probes launch latency and transfer bandwidth, not compute, so ops bound by device compute or device memory (sort,
+// gemm_int8, gemv, reduce, stencil, math) and the diagnostics (backends, spill, occupancy) stay on the current device.
+struct op_traffic {
+    const char *name;
+    int vectors;
+};
+const op_traffic op_traffic_table[] = {
+    {"gather", 3}, {"scatter", 3}, {"scatter_add", 3}, {"hist", 1}, {"topk", 1}, {"threshold", 2}, {"packed_add", 3},
+    {"float_add", 18}, {"independent", 3}, {"steady", 3 * (STEADY_REPS + 1)},
+};
+
+// Operations for the axis reductions
+enum reduce_op { REDUCE_SUM, REDUCE_MAX };
+
+// Elementwise math functions and the precision tiers they are available in
+enum math_func { MATH_EXP, MATH_LOG, MATH_SQRT, MATH_SIGMOID, MATH_FUNCS };
+enum math_tier { MATH_FULL, MATH_NATIVE, MATH_HALF, MATH_HOST, MATH_TIERS };
+const char *math_func_names[MATH_FUNCS] = {"exp", "log", "sqrt", "sigmoid"};
+const char *math_tier_names[MATH_TIERS] = {"full", "native", "half", "host"}; // Device built-ins, then host polynomials
+
+// Last values set for the arguments of one kernel, so unchanged arguments can be skipped
+struct kernel_arg_cache {
+    cl_kernel kernel;
+    size_t sizes[MAX_KERNEL_ARGS]; // 0 if the argument has not been set through the cache
+    bool local[MAX_KERNEL_ARGS];   // Whether the argument is a local memory size (NULL value)
+    unsigned char values[MAX_KERNEL_ARGS][KERNEL_ARG_BYTES];
+};
+
+// A host vector mirrored on the device by the memory manager. The host copy is the home of the data: the device
+// buffer exists only while the vector is resident and is written back before eviction if the device changed it.
+struct managed_vector {
+    void *host;               // Host copy, NULL if the slot is free
+    size_t bytes;             // Size of the vector
+    cl_mem mem;               // Device buffer, NULL while evicted
+    bool device_dirty;        // Whether the device buffer is newer than the host copy
+    unsigned long last_used;  // Op counter value at the last acquire, for least-recently-used eviction
+};
+
+// Resource use of one kernel on the device, with the device limits the occupancy estimate needs
+struct kernel_resources {
+    size_t work_group_size;     // CL_KERNEL_WORK_GROUP_SIZE: largest local size the kernel can be launched with
+    size_t preferred_multiple;  // CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE: SIMD width the local size should fill
+    cl_ulong private_mem;       // CL_KERNEL_PRIVATE_MEM_SIZE: private memory per work-item in bytes
+    cl_ulong local_mem;         // CL_KERNEL_LOCAL_MEM_SIZE: local memory per work-group, including set __local arguments
+    cl_uint compute_units;      // CL_DEVICE_MAX_COMPUTE_UNITS
+    cl_ulong device_local_mem;  // CL_DEVICE_LOCAL_MEM_SIZE: most local memory one work-group can use
+};
+
+// A release handed to the reclaim thread: a raw host block (header included) or a device buffer
+struct reclaim_item {
+    void *block;
+    cl_mem buffer;
+};
+
+// A stencil kernel built for one radius, coefficient set and vector width
+struct stencil_entry {
+    int radius;
+    int width;
+    float coeffs[2 * STENCIL_MAX_RADIUS + 1];
+    cl_program program;
+    cl_kernel kernel;
+};
 
 int SZ = 100000000; // Default size of vectors
 
 int *v1, *v2, *v_out; // Pointers for input and output vectors
 
+int prefetch_distance = 256; // Software prefetch distance in ints, calibrated at startup
+bool prefetch_calibrated = false; // Whether calibrate_prefetch_distance() has run
+
+const char *startup_names[MAX_STARTUP_PHASES]; // Names of the timed startup phases
+double startup_times[MAX_STARTUP_PHASES];     // Startup phase durations in ms
+int num_startup_phases = 0;                   // Number of startup phases recorded
+bool startup_done = false;                    // Set once the breakdown is printed, later builds and queues are not startup
+
 cl_mem bufV1, bufV2, bufV_out; // OpenCL memory objects for vectors
 
 cl_device_id device_id;  // OpenCL device id
 cl_context context;      // OpenCL context
 cl_program program;      // OpenCL program
 cl_kernel kernel;        // OpenCL kernel
-cl_command_queue queue;  // OpenCL command queue
+const char *program_file;    // Source file of program, built again when switching devices
+const char *add_kernel_name; // Name of kernel in program
+cl_command_queue queue;  // OpenCL command queue, the first queue of the pool
+cl_command_queue queue_pool[NUM_QUEUES]; // Pool of command queues on the device
+size_t queue_load[NUM_QUEUES];           // Work-items enqueued on each pool queue since it was last finished
+int queue_next = 0;                      // Next queue for round-robin assignment, and the first one tried on a load tie
+bool pool_batch = false;                 // Whether ops are being spread across the pool by next_batch_op()
+bool batch_used[NUM_QUEUES];             // Pool queues given to ops of the current batch
+
+const char *kernel_cache_names[MAX_KERNELS]; // Names of the kernels created by get_kernel()
+cl_kernel kernel_cache[MAX_KERNELS];         // Kernels created by get_kernel()
+int num_cached_kernels = 0;                  // Number of entries in kernel_cache
+kernel_arg_cache arg_caches[MAX_ARG_KERNELS]; // Argument values of the kernels set through set_kernel_arg()
+int num_arg_caches = 0;                      // Number of entries in arg_caches
+long kernel_args_set = 0;                    // Arguments passed on to clSetKernelArg()
+long kernel_args_skipped = 0;                // Arguments skipped because their value had not changed
+int pool_used[NUM_QUEUES];                    // Pool queues used by the steady-state add, finished before it returns
+double math_error[MATH_FUNCS][MATH_TIERS];   // Largest error of each math tier on the probe inputs
+double math_ns[MATH_FUNCS][MATH_TIERS];      // Nanoseconds per element of each math tier, without transfers
+double math_transfer_ns = 0;                 // Nanoseconds per element to copy floats to the device and back
+bool math_calibrated = false;                // Whether calibrate_math() has run
+stencil_entry stencil_cache[STENCIL_CACHE];  // Stencil kernels built by stencil_kernel()
+int num_stencils = 0;                        // Number of entries in stencil_cache
+int next_stencil = 0;                        // Entry replaced when stencil_cache is full
+reclaim_item reclaim_queue[RECLAIM_QUEUE];   // Releases waiting for the reclaim thread, a ring buffer
+int reclaim_head = 0;                        // Oldest entry of reclaim_queue
+int reclaim_count = 0;                       // Number of entries in reclaim_queue
+bool reclaim_stop = false;                   // Set by reclaim_shutdown() once no more releases will come
+std::thread reclaim_thread;                  // Thread making the queued releases, started on first use
+std::mutex reclaim_mutex;                    // Guards reclaim_queue, reclaim_count and reclaim_stop
+std::condition_variable reclaim_ready;       // Signalled when a release is queued or the thread should stop
+std::condition_variable reclaim_idle;        // Signalled when the reclaim thread has made every queued release
+bool reclaim_busy = false;                   // Whether the reclaim thread is making a release right now
+managed_vector managed[MAX_MANAGED];         // Vectors tracked by the device memory manager
+size_t device_budget = 0;                    // Device bytes the manager plans with, set on first use
+unsigned long managed_clock = 0;             // Ops begun so far; vectors acquired in the current op are not evicted
+long managed_evictions = 0;                  // Vectors evicted to the host so far
+long managed_uploads = 0;                    // Vectors uploaded to the device so far
+cl_command_queue profiling_queue = NULL;     // Queue with profiling enabled, created by profile_kernel_ms()
 cl_event event = NULL;   // OpenCL event object
 int err;                 // OpenCL error variable
 
 cl_device_id create_device(); // Function declaration for creating OpenCL device
 void setup_openCL_device_context_queue_kernel(char *filename, char *kernelname); // Function declaration for setting up OpenCL context, device, queue, and kernel
-cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename); // Function declaration for building OpenCL program from source
+void open_device(const char *filename, const char *kernelname); // Function declaration for creating the context, program, queues and kernel on device_id
+void close_device(); // Function declaration for releasing the kernels, queues, program and context of device_id
+void switch_device(cl_device_id dev); // Function declaration for moving the OpenCL state and managed vectors to another device
+size_t op_transfer_bytes(const char *op); // Function declaration for getting the host-device traffic of a transfer-bound op
+size_t resident_bytes(); // Function declaration for getting the bytes of managed vectors resident on the device
+cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename, const char *options); // Function declaration for building OpenCL program from source
 void setup_kernel_memory(); // Function declaration for setting up OpenCL memory buffers
 void copy_kernel_args();    // Function declaration for copying kernel arguments
 void free_memory();         // Function declaration for freeing allocated memory
 void init(int *&A, int size); // Function declaration for initializing vectors with random values
 void print(int *A, int size); // Function declaration for printing vectors
+size_t nt_store_threshold();  // Function declaration for getting the streaming store size threshold
+bool use_streaming_stores(int size); // Function declaration for deciding whether an output should bypass the cache
+void add_host(int *A, int *B, int *C, int size); // Function declaration for adding vectors on the host
+long host_tile_size(); // Function declaration for getting the L2-sized tile length for host multi-operand ops
+void add_host_multi(int **srcs, int nsrc, int *C, int size); // Function declaration for adding several vectors on the host
+void calibrate_prefetch_distance(); // Function declaration for tuning the software prefetch distance
+void record_startup(const char *name, std::chrono::high_resolution_clock::time_point start); // Function declaration for recording a startup phase
+void print_startup_breakdown(); // Function declaration for printing the startup phase timings
+void program_binary_name(cl_device_id dev, const char *filename, const char *options, char *name, size_t name_size); // Function declaration for naming the cached binary of a program
+cl_program load_program_binary(cl_context ctx, cl_device_id dev, const char *filename, const char *options); // Function declaration for loading a cached program binary
+void save_program_binary(cl_program prog, cl_device_id dev, const char *filename, const char *options); // Function declaration for caching a program binary
+int next_queue(size_t work); // Function declaration for choosing a pool queue for a command
+int enqueue_ndrange_pooled(cl_kernel k, size_t global_size, int max_parts, int *queues); // Function declaration for splitting an NDRange across the queue pool
+void finish_queues(const int *queues, int count); // Function declaration for waiting until pool queues have drained
+void begin_pool_batch(); // Function declaration for starting a batch of independent ops spread across the queue pool
+void next_batch_op(size_t work); // Function declaration for moving the next op of a batch to its own pool queue
+void end_pool_batch(); // Function declaration for waiting for every op of a batch
+void benchmark_queue_pool(cl_kernel k, size_t global_size); // Function declaration for timing the kernel with different queue counts
+void check_error(cl_int err, const char *message); // Function declaration for exiting on an OpenCL error
+cl_kernel get_kernel(const char *name); // Function declaration for getting a cached kernel from the program
+cl_int set_kernel_arg(cl_kernel k, cl_uint index, size_t size, const void *value); // Function declaration for setting a kernel argument unless it is unchanged
+void forget_kernel_args(cl_kernel k); // Function declaration for dropping the remembered arguments of a released kernel
+size_t round_up(size_t value, size_t multiple); // Function declaration for rounding a work size up
+void run_kernel(cl_kernel k, size_t global_size, size_t local_size); // Function declaration for running a 1D kernel to completion
+void gather_ocl(cl_mem idx, cl_mem src, cl_mem out, int size); // Function declaration for gathering on the device
+void scatter_ocl(cl_mem idx, cl_mem values, cl_mem out, int size); // Function declaration for scattering on the device
+double measure_collision_rate(cl_mem idx, int size); // Function declaration for estimating how often scatter indices repeat
+void scatter_add_ocl(cl_mem idx, cl_mem values, cl_mem out, int size, int out_size); // Function declaration for scatter-add on the device
+long scatter_mismatches(const int *out, const int *idx, const int *values, int size, int out_size); // Function declaration for checking a scatter result on the host
+long scatter_add_mismatches(cl_mem idx, const int *host_idx, int size, int out_size); // Function declaration for checking scatter-add against the host
+bool fits_local_memory(size_t bytes); // Function declaration for checking whether a private copy fits in local memory
+size_t privatized_global_size(); // Function declaration for getting the global size of grid-stride privatized kernels
+void histogram_ocl(cl_mem data, int size, cl_mem hist, int num_bins, int min_value); // Function declaration for histogramming on the device
+void histogram_host(const int *data, int size, int *hist, int num_bins, int min_value); // Function declaration for histogramming on the host
+int host_threads(); // Function declaration for getting the number of host threads
+void exclusive_scan_ocl(cl_mem data, int size); // Function declaration for an in-place exclusive scan on the device
+void radix_sort_ocl(cl_mem keys, cl_mem values, int size, bool wide_keys); // Function declaration for sorting keys (and values) on the device
+template <typename Key> void radix_sort_host(Key *keys, int *values, int size); // Function declaration for sorting keys (and values) on the host
+void topk_ocl(cl_mem data, int size, int k, int *result); // Function declaration for finding the k largest values on the device
+int count_above_ocl(cl_mem data, int size, int threshold); // Function declaration for counting values above a threshold on the device
+int select_above_ocl(cl_mem data, int size, int threshold, cl_mem out); // Function declaration for compacting values above a threshold on the device
+int bit_width(unsigned value); // Function declaration for getting the number of bits needed for a value
+size_t pack_host(const int *data, int size, int *headers, unsigned **words); // Function declaration for bit-packing a vector on the host
+void unpack_host(const unsigned *words, int size, int bits, const int *bases, int *out); // Function declaration for unpacking a fixed-width vector on the host
+void parallel_for(int count, void (*body)(int begin, int end, void *arg), void *arg); // Function declaration for splitting a loop across host threads
+void run_kernel_2d(cl_kernel k, size_t cols, size_t rows); // Function declaration for running a 2D kernel over a matrix
+void matrix_shape(int size, int *rows, int *cols); // Function declaration for viewing a vector of the given size as a matrix
+size_t storage_size(storage_type type); // Function declaration for getting the bytes per element of a storage type
+void vector_add_float_ocl(cl_mem a, cl_mem b, cl_mem out, int size, storage_type type); // Function declaration for adding float vectors on the device
+void matrix_add_float_ocl(cl_mem a, cl_mem b, cl_mem out, int rows, int cols, int ld, bool column_major, storage_type type); // Function declaration for adding float matrices on the device
+uint16_t float_to_half(float value); // Function declaration for converting one float to half
+float half_to_float(uint16_t value); // Function declaration for converting one half to float
+uint16_t float_to_bf16(float value); // Function declaration for converting one float to bfloat16
+float bf16_to_float(uint16_t value); // Function declaration for converting one bfloat16 to float
+void float_to_half_host(const float *in, uint16_t *out, int size); // Function declaration for converting floats to halves on the host
+void half_to_float_host(const uint16_t *in, float *out, int size); // Function declaration for converting halves to floats on the host
+void float_to_bf16_host(const float *in, uint16_t *out, int size); // Function declaration for converting floats to bfloat16 on the host
+void bf16_to_float_host(const uint16_t *in, float *out, int size); // Function declaration for converting bfloat16 to floats on the host
+long conversion_mismatches(); // Function declaration for checking the vectorized host conversions against the scalar ones
+void quantize_rows_host(const float *x, int rows, int cols, int ld, int8_t *q, float *scales); // Function declaration for quantizing matrix rows to int8
+int dot_int8_host(const int8_t *a, const int8_t *b, int k); // Function declaration for an int8 dot product on the host
+void gemm_int8_host(const int8_t *a, const int8_t *b, int M, int N, int K, const float *scale_a, const float *scale_b, float *out); // Function declaration for int8 matrix multiply on the host
+void gemm_int8_ocl(cl_mem a, cl_mem b, int M, int N, int K, cl_mem scale_a, cl_mem scale_b, cl_mem out); // Function declaration for int8 matrix multiply on the device
+void gemv_ocl(cl_mem a, cl_mem x, cl_mem y, int rows, int cols, int ld, bool column_major); // Function declaration for matrix-vector multiply on the device
+void gemv_host(const float *a, const float *x, float *y, int rows, int cols, int ld, bool column_major); // Function declaration for matrix-vector multiply on the host
+void ger_ocl(cl_mem a, cl_mem u, cl_mem v, float alpha, int rows, int cols, int ld, bool column_major); // Function declaration for a rank-1 update on the device
+void matrix_add_ger_ocl(cl_mem a, cl_mem b, cl_mem out, cl_mem u, cl_mem v, float alpha, int rows, int cols, int ld, bool column_major); // Function declaration for a matrix add fused with a rank-1 update on the device
+void reduce_axis_ocl(cl_mem a, cl_mem b, cl_mem out, int rows, int cols, int ld, bool column_major, bool per_row, reduce_op op); // Function declaration for reducing a matrix (or a matrix sum) along one axis on the device
+void reduce_axis_host(const float *a, const float *b, float *out, int rows, int cols, int ld, bool column_major, bool per_row, reduce_op op); // Function declaration for reducing a matrix (or a matrix sum) along one axis on the host
+int stencil_width(); // Function declaration for choosing the stencil vector width for the device
+cl_kernel stencil_kernel(int radius, const float *coeffs, int width); // Function declaration for getting a stencil kernel built for its parameters
+void stencil_ocl(cl_mem in, cl_mem out, int size, int radius, const float *coeffs, int width); // Function declaration for applying a 1D stencil on the device
+void stencil_host(const float *in, float *out, int size, int begin, int end, int radius, const float *coeffs); // Function declaration for applying a 1D stencil on the host
+float exp_poly(float x); // Function declaration for a polynomial exp on the host
+float log_poly(float x); // Function declaration for a polynomial log on the host
+#if defined(__AVX2__)
+__m256 exp_poly8(__m256 x); // Function declaration for a polynomial exp of 8 floats
+__m256 log_poly8(__m256 x); // Function declaration for a polynomial log of 8 floats
+#endif
+void math_host_block(math_func f, const float *in, float *out, int size); // Function declaration for applying a math function on one host thread
+void math_host(math_func f, const float *in, float *out, int size); // Function declaration for applying a math function on the host
+void math_ocl(math_func f, math_tier tier, cl_mem in, cl_mem out, int size); // Function declaration for applying a math function on the device
+float math_input(math_func f, long i, long n); // Function declaration for spreading n inputs over a math function's domain
+double math_reference(math_func f, double x); // Function declaration for the double precision result of a math function
+double math_error_of(float result, double reference); // Function declaration for the error of one math result
+void calibrate_math(); // Function declaration for measuring the error and speed of every math tier
+math_tier select_math_tier(math_func f, double budget, bool host_data); // Function declaration for choosing the fastest math tier within an error budget
+math_tier apply_math(math_func f, const float *in, float *out, int size, double budget); // Function declaration for applying a math function to host data within an error budget
+void reclaim_worker(); // Function declaration for the reclaim thread's loop
+bool reclaim_push(reclaim_item item); // Function declaration for queueing a release on the reclaim thread
+void reclaim_shutdown(); // Function declaration for finishing the queued releases and stopping the reclaim thread
+void reclaim_drain(); // Function declaration for waiting until the reclaim thread has made every queued release
+void deferred_release(cl_mem buf); // Function declaration for releasing a tracked buffer, large ones on the reclaim thread
+void fast_exit(); // Function declaration for ending the process without teardown
+size_t get_device_budget(); // Function declaration for getting the device memory budget
+int manage_vector(void *host, size_t bytes); // Function declaration for registering a host vector with the device memory manager
+void begin_managed_op(); // Function declaration for starting an op, after which earlier vectors may be evicted
+bool evict_vector(); // Function declaration for evicting the least recently used vector to the host
+cl_mem create_buffer_spilling(cl_mem_flags flags, size_t bytes, void *host_ptr, cl_int *errcode); // Function declaration for creating a device buffer, evicting vectors to make room
+cl_mem acquire_vector(int v, bool read, bool write); // Function declaration for making a managed vector resident on the device
+void sync_vector(int v); // Function declaration for bringing the host copy of a managed vector up to date
+void unmanage_vector(int v); // Function declaration for dropping a vector from the device memory manager
+kernel_resources query_kernel_resources(cl_kernel k); // Function declaration for querying the resource use of a kernel
+double estimate_occupancy(const kernel_resources &r, size_t local_size); // Function declaration for estimating the occupancy of a kernel at a local size
+const char *prune_local_size(const kernel_resources &r, size_t local_size); // Function declaration for checking a local size candidate, returns why it is pruned or NULL
+double profile_kernel_ms(cl_kernel k, size_t global_size, size_t local_size); // Function declaration for timing a kernel with profiling events
+void print_kernel_report(const char *name, cl_kernel k, size_t local_size, double ms); // Function declaration for printing the resource and occupancy report of a kernel
+
+// Memory owned by one backend: a device buffer for the OpenCL buffer backend, a pointer for the others
+struct backend_buffer {
+    cl_mem mem;
+    int *ptr;
+    size_t bytes;
+    int managed; // Device memory manager handle of a wrapped host vector, -1 otherwise
+};
+
+// Common op interface of the execution backends. A backend B derives from backend<B> and provides the *_impl
+// members; ops take a backend<B>& and every call resolves to B at compile time, so the hot loops carry no virtual
+// calls and a new backend plugs in as a new B without changes to the ops. alloc() buffers are owned by the backend
+// and freed by release(); wrap() buffers hold a host vector the caller keeps, unwrap() drops the backend's side.
+template <typename B>
+struct backend {
+    const char *name() { return self().name_impl(); }
+    bool available() { return self().available_impl(); }
+    backend_buffer alloc(int size) { return self().alloc_impl(size); }
+    backend_buffer wrap(int *host, int size) { return self().wrap_impl(host, size); }
+    void upload(backend_buffer &dst, const int *src, int size) { self().upload_impl(dst, src, size); }
+    void download(int *dst, const backend_buffer &src, int size) { self().download_impl(dst, src, size); }
+    void add(const backend_buffer &a, const backend_buffer &b, backend_buffer &c, int size) { self().add_impl(a, b, c, size); }
+    void gather(const backend_buffer &idx, const backend_buffer &src, backend_buffer &out, int size) { self().gather_impl(idx, src, out, size); }
+    void scatter(const backend_buffer &idx, const backend_buffer &values, backend_buffer &out, int size) { self().scatter_impl(idx, values, out, size); }
+    void release(backend_buffer &buf) { self().release_impl(buf); }
+    void unwrap(backend_buffer &buf) { self().unwrap_impl(buf); }
+    B &self() { return static_cast<B &>(*this); }
+};
+
+// Memory handling shared by the backends that compute on host memory
+template <typename B>
+struct host_backend : backend<B> {
+    bool available_impl() { return true; }
+    backend_buffer alloc_impl(int size) { return {NULL, (int *)tracked_malloc(sizeof(int) * size), sizeof(int) * size, -1}; }
+    backend_buffer wrap_impl(int *host, int size) { return {NULL, host, sizeof(int) * size, -1}; }
+    void upload_impl(backend_buffer &dst, const int *src, int size) { memmove(dst.ptr, src, sizeof(int) * size); }
+    void download_impl(int *dst, const backend_buffer &src, int size) { memmove(dst, src.ptr, sizeof(int) * size); }
+    void release_impl(backend_buffer &buf) { deferred_free(buf.ptr); }
+    void unwrap_impl(backend_buffer &) {}
+};
+
+// Backend running the kernels on OpenCL buffers. Wrapped vectors go through the device memory manager, so they
+// are uploaded when first used and may be evicted to the host between ops.
+struct ocl_buffer_backend : backend<ocl_buffer_backend> {
+    const char *name_impl() { return "opencl-buffer"; }
+    bool available_impl() { return true; }
+    backend_buffer alloc_impl(int size);
+    backend_buffer wrap_impl(int *host, int size);
+    void upload_impl(backend_buffer &dst, const int *src, int size);
+    void download_impl(int *dst, const backend_buffer &src, int size);
+    void add_impl(const backend_buffer &a, const backend_buffer &b, backend_buffer &c, int size);
+    void gather_impl(const backend_buffer &idx, const backend_buffer &src, backend_buffer &out, int size);
+    void scatter_impl(const backend_buffer &idx, const backend_buffer &values, backend_buffer &out, int size);
+    void release_impl(backend_buffer &buf);
+    void unwrap_impl(backend_buffer &buf);
+    cl_mem device_mem(const backend_buffer &buf, bool read, bool write);
+};
+
+// Backend running the kernels on coarse-grained OpenCL shared virtual memory
+struct ocl_svm_backend : backend<ocl_svm_backend> {
+    const char *name_impl() { return "opencl-svm"; }
+    bool available_impl();
+    backend_buffer alloc_impl(int size);
+    backend_buffer wrap_impl(int *host, int size);
+    void upload_impl(backend_buffer &dst, const int *src, int size);
+    void download_impl(int *dst, const backend_buffer &src, int size);
+    void add_impl(const backend_buffer &a, const backend_buffer &b, backend_buffer &c, int size);
+    void gather_impl(const backend_buffer &idx, const backend_buffer &src, backend_buffer &out, int size);
+    void scatter_impl(const backend_buffer &idx, const backend_buffer &values, backend_buffer &out, int size);
+    void release_impl(backend_buffer &buf);
+    void unwrap_impl(backend_buffer &buf);
+    void run_impl(const char *name, const backend_buffer &a, const backend_buffer &b, const backend_buffer &c, int size);
+};
+
+// Backend using the SIMD host code on every host thread
+struct native_backend : host_backend<native_backend> {
+    const char *name_impl() { return "native"; }
+    void add_impl(const backend_buffer &a, const backend_buffer &b, backend_buffer &c, int size);
+    void gather_impl(const backend_buffer &idx, const backend_buffer &src, backend_buffer &out, int size);
+    void scatter_impl(const backend_buffer &idx, const backend_buffer &values, backend_buffer &out, int size);
+};
+
+// Backend with plain scalar loops on one thread, the reference the others are checked against
+struct reference_backend : host_backend<reference_backend> {
+    const char *name_impl() { return "reference"; }
+    void add_impl(const backend_buffer &a, const backend_buffer &b, backend_buffer &c, int size);
+    void gather_impl(const backend_buffer &idx, const backend_buffer &src, backend_buffer &out, int size);
+    void scatter_impl(const backend_buffer &idx, const backend_buffer &values, backend_buffer &out, int size);
+};
+
+ocl_buffer_backend device_backend;     // Backend of the main add and the ops on v1, v2 and v_out
+backend_buffer dev_v1, dev_v2, dev_v_out; // v1, v2 and v_out wrapped by device_backend
+
+template <typename Body> double best_time_ms(Body body); // Function declaration for timing the fastest of BENCH_REPS runs
+template <typename B> double backend_add(backend<B> &be, const int *a, const int *b, int *c, int size); // Function declaration for adding vectors on a backend
+template <typename B> void check_backend_add(backend<B> &be); // Function declaration for timing and checking the add on a backend
+template <typename B> void check_backend_gather_scatter(backend<B> &be); // Function declaration for checking gather and scatter on a backend
+void run_vector_op(const char *op); // Function declaration for running an extra vector op on the add result
 
 int main(int argc, char **argv) {
+    atexit(print_alloc_summary); // Report peak memory use when the program exits
+
     if (argc > 1) {
         SZ = atoi(argv[1]); // Set size of vectors from command line argument
     }
+    const char *op = argc > 2 ? argv[2] : NULL; // Optional vector op to run on the add result
 
+    auto init_start = std::chrono::high_resolution_clock::now(); // Start init time measurement
+    perf_begin(); // Start hardware counters for the init phase
     init(v1, SZ); // Initialize vector v1
     init(v2, SZ); // Initialize vector v2
     init(v_out, SZ); // Initialize output vector v_out
+    auto init_stop = std::chrono::high_resolution_clock::now(); // Stop init time measurement
+    std::chrono::duration<double, std::milli> init_time = init_stop - init_start; // Calculate init elapsed time
+    printf("Init Time: %f ms\n", init_time.count()); // Print init time
+    perf_end("init"); // Print hardware counters for the init phase
 
-    size_t global[1] = {(size_t)SZ}; // Global work size for OpenCL kernel
+    // Large outputs are written once, so use the streaming kernel that handles 4 elements per work-item
+    bool streaming = use_streaming_stores(SZ);
+    size_t global[1] = {streaming ? (size_t)(SZ + 3) / 4 : (size_t)SZ}; // Global work size for OpenCL kernel
 
     print(v1, SZ); // Print vector v1
     print(v2, SZ); // Print vector v2
-   
+
+    if (!FAST_START) {
+        perf_begin(); // Start hardware counters for the calibration phase
+        calibrate_prefetch_distance(); // Tune the host prefetch distance for this machine
+        printf("Host prefetch distance: %d ints\n", prefetch_distance); // Print calibrated prefetch distance
+        perf_end("calibrate"); // Print hardware counters for the calibration phase
+    }
+
+    auto host_start = std::chrono::high_resolution_clock::now(); // Start host time measurement
+    perf_begin(); // Start hardware counters for the host add
+    add_host(v1, v2, v_out, SZ); // Add vectors on the host
+    auto host_stop = std::chrono::high_resolution_clock::now(); // Stop host time measurement
+    std::chrono::duration<double, std::milli> host_time = host_stop - host_start; // Calculate host elapsed time
+    print(v_out, SZ); // Print host output vector v_out
+    printf("Host Execution Time: %f ms\n", host_time.count()); // Print host execution time
+    perf_end("add_host"); // Print hardware counters for the host add
+
     // Setup OpenCL device, context, queue, and kernel
-    setup_openCL_device_context_queue_kernel((char *)"./vector_ops_ocl.cl", (char *)"vector_add_ocl");
+    setup_openCL_device_context_queue_kernel((char *)"./vector_ops_ocl.cl",
+                                             (char *)(streaming ? "vector_add_nt_ocl" : "vector_add_ocl"));
+    print_startup_breakdown(); // Print how long each startup step took
     setup_kernel_memory(); // Setup OpenCL memory buffers
-    copy_kernel_args();    // Copy kernel arguments
 
     auto start = std::chrono::high_resolution_clock::now(); // Start time measurement
 
-    // Enqueue OpenCL kernel for execution
-    clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, NULL, 0, NULL, &event);
-    clWaitForEvents(1, &event); // Wait for kernel execution to finish
+    // Add on the device backend, split across the queue pool, and wait for it to finish
+    device_backend.add(dev_v1, dev_v2, dev_v_out, SZ);
     
     // Read output vector v_out from OpenCL memory buffer
-    clEnqueueReadBuffer(queue, bufV_out, CL_TRUE, 0, SZ * sizeof(int), &v_out[0], 0, NULL, NULL);
+    device_backend.download(v_out, dev_v_out, SZ);
     print(v_out, SZ); // Print output vector v_out
 
     auto stop = std::chrono::high_resolution_clock::now(); // Stop time measurement
     std::chrono::duration<double, std::milli> elapsed_time = stop - start; // Calculate elapsed time
 
     printf("Kernel Execution Time: %f ms\n", elapsed_time.count()); // Print kernel execution time
-    free_memory(); // Free allocated memory
+
+    if (QUEUE_BENCHMARK) {
+        benchmark_queue_pool(kernel, global[0]); // Compare one queue against the pool, with the arguments of the add
+    }
+
+    if (op != NULL) {
+        run_vector_op(op); // Run the requested vector op on the device buffers
+    }
+    if (FAST_EXIT) {
+        fast_exit(); // Leave the buffers, context and host vectors to the OS
+    }
+
+    auto free_start = std::chrono::high_resolution_clock::now(); // Start teardown time measurement
+    free_memory(); // Free allocated memory, the large blocks on the reclaim thread
+    std::chrono::duration<double, std::milli> free_time = std::chrono::high_resolution_clock::now() - free_start;
+    reclaim_shutdown(); // The process cannot exit before the reclaim thread is done, so its join counts too
+    std::chrono::duration<double, std::milli> teardown_time = std::chrono::high_resolution_clock::now() - free_start;
+    printf("Teardown Time: %f ms (%f ms before the reclaim thread join)\n", teardown_time.count(), free_time.count()); // Print time spent freeing memory; FAST_EXIT skips all of it
 }
 
 // Function definition for initializing vectors with random values
 void init(int *&A, int size) {
-    A = (int *)malloc(sizeof(int) * size); // Allocate memory for vector A
+    A = (int *)tracked_malloc(sizeof(int) * size); // Allocate memory for vector A
 
     for (long i = 0; i < size; i++) {
         A[i] = rand() % 100; // Initialize each element of A with a random value
     }
 }
 
+// Function definition for getting the streaming store size threshold
+size_t nt_store_threshold() {
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE); // Size of the last level cache in bytes
+    if (llc <= 0) {
+        llc = sysconf(_SC_LEVEL2_CACHE_SIZE); // Fall back to L2 when there is no L3
+    }
+    return llc > 0 ? (size_t)llc : NT_STORE_THRESHOLD; // Outputs larger than the cache would only evict useful lines
+}
+
+// Function definition for deciding whether an output should bypass the cache
+bool use_streaming_stores(int size) {
+    return (size_t)size * sizeof(int) >= nt_store_threshold();
+}
+
+// Function definition for adding vectors on the host
+void add_host(int *A, int *B, int *C, int size) {
+    long i = 0;
+#if defined(__SSE2__)
+    if (use_streaming_stores(size)) {
+        // Scalar head until C is 16-byte aligned, as streaming stores need aligned addresses
+        for (; i < size && ((uintptr_t)&C[i] & 15) != 0; i++) {
+            C[i] = A[i] + B[i];
+        }
+        // Streaming stores write C without reading its lines into the cache first
+        for (; i + 4 <= size; i += 4) {
+            __m128i a = _mm_loadu_si128((const __m128i *)&A[i]);
+            __m128i b = _mm_loadu_si128((const __m128i *)&B[i]);
+            _mm_stream_si128((__m128i *)&C[i], _mm_add_epi32(a, b));
+        }
+        _mm_sfence(); // Order streaming stores before any later reads of C
+    }
+#endif
+    for (; i < size; i++) {
+        C[i] = A[i] + B[i]; // Add remaining elements with regular stores
+    }
+}
+
+// Function definition for getting the L2-sized tile length for host multi-operand ops
+long host_tile_size() {
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE); // Size of the L2 cache in bytes
+    if (l2 <= 0) {
+        l2 = L2_CACHE_SIZE;
+    }
+    // Half of L2 holds the output tile plus the input being streamed, leaving room for everything else
+    long tile = l2 / 2 / (2 * (long)sizeof(int));
+    return tile - tile % CACHE_LINE_INTS; // Keep tiles a whole number of cache lines
+}
+
+// Function definition for adding several vectors on the host
+void add_host_multi(int **srcs, int nsrc, int *C, int size) {
+    if (!prefetch_calibrated) {
+        calibrate_prefetch_distance(); // Deferred until first use in fast start mode
+    }
+    long tile = host_tile_size();
+
+    // Each tile of C stays in L2 while the inputs are added into it one at a time, so only
+    // two streams are live at once instead of nsrc + 1 competing for the hardware prefetchers
+    for (long start = 0; start < size; start += tile) {
+        long end = start + tile < size ? start + tile : size;
+
+        for (int k = 0; k < nsrc; k++) {
+            int *S = srcs[k];
+            for (long line = start; line < end; line += CACHE_LINE_INTS) {
+                long ahead = line + prefetch_distance;
+                if (prefetch_distance > 0 && ahead < size) {
+                    __builtin_prefetch(&S[ahead], 0, 0); // Prefetch one cache line per line processed
+                }
+                long line_end = line + CACHE_LINE_INTS < end ? line + CACHE_LINE_INTS : end;
+                if (k == 0) {
+                    for (long i = line; i < line_end; i++) {
+                        C[i] = S[i]; // First input initialises the output tile
+                    }
+                } else {
+                    for (long i = line; i < line_end; i++) {
+                        C[i] += S[i]; // Remaining inputs accumulate into the cached tile
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Function definition for tuning the software prefetch distance
+void calibrate_prefetch_distance() {
+    const int candidates[] = {0, 64, 128, 256, 512, 1024}; // Candidate distances in ints
+    const int nsrc = 4;                                    // Operands in the calibration expression
+    const int size = 2 * 1024 * 1024;                      // Elements per operand, well beyond L2
+    int *srcs[nsrc];
+
+    prefetch_calibrated = true; // Set first, as the timed runs below go through add_host_multi
+    int *out = (int *)tracked_malloc(sizeof(int) * size);
+
+    for (int k = 0; k < nsrc; k++) {
+        srcs[k] = (int *)tracked_malloc(sizeof(int) * size);
+        for (long i = 0; i < size; i++) {
+            srcs[k][i] = (int)i; // Touch every page so page faults are not timed
+        }
+    }
+
+    double best_time = -1;
+    int best = prefetch_distance;
+    for (int c = 0; c < (int)(sizeof(candidates) / sizeof(candidates[0])); c++) {
+        prefetch_distance = candidates[c];
+        double fastest = -1;
+        for (int rep = 0; rep < 3; rep++) {
+            auto start = std::chrono::high_resolution_clock::now();
+            add_host_multi(srcs, nsrc, out, size);
+            auto stop = std::chrono::high_resolution_clock::now();
+            double t = std::chrono::duration<double, std::milli>(stop - start).count();
+            if (fastest < 0 || t < fastest) {
+                fastest = t; // Keep the fastest repetition to filter out noise
+            }
+        }
+        if (best_time < 0 || fastest < best_time) {
+            best_time = fastest;
+            best = candidates[c];
+        }
+    }
+    prefetch_distance = best;
+
+    for (int k = 0; k < nsrc; k++) {
+        tracked_free(srcs[k]);
+    }
+    tracked_free(out);
+}
+
+// Function definition for recording a startup phase, ignored once the startup breakdown has been printed
+void record_startup(const char *name, std::chrono::high_resolution_clock::time_point start) {
+    if (startup_done) {
+        return; // Stencil builds and device switches during the ops would otherwise fill the table
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+    if (num_startup_phases < MAX_STARTUP_PHASES) {
+        startup_names[num_startup_phases] = name;
+        startup_times[num_startup_phases] = elapsed.count();
+        num_startup_phases++;
+    }
+}
+
+// Function definition for printing the startup phase timings
+void print_startup_breakdown() {
+    double total = 0;
+    printf("Startup breakdown%s:\n", FAST_START ? " (fast start)" : "");
+    for (int i = 0; i < num_startup_phases; i++) {
+        printf("  %-36s %10.3f ms\n", startup_names[i], startup_times[i]);
+        total += startup_times[i];
+    }
+    printf("  %-36s %10.3f ms\n", "total", total);
+    startup_done = true;
+}
+
 // Function definition for printing vectors
 void print(int *A, int size) {
     if (PRINT == 0) {
@@ -98,27 +701,24 @@ void print(int *A, int size) {
 // Function definition for freeing allocated memory
 void free_memory() {
     // Release OpenCL memory objects
-    clReleaseMemObject(bufV1);
-    clReleaseMemObject(bufV2);
-    clReleaseMemObject(bufV_out);
+    device_backend.unwrap(dev_v1);
+    device_backend.unwrap(dev_v2);
+    device_backend.unwrap(dev_v_out);
 
-    // Release OpenCL kernel, command queue, program, and context
-    clReleaseKernel(kernel);
-    clReleaseCommandQueue(queue);
-    clReleaseProgram(program);
-    clReleaseContext(context);
+    // Release OpenCL kernels, command queues, program, and context
+    close_device();
 
-    free(v1);  // Free memory allocated for v1
-    free(v2);  // Free memory allocated for v2
-    free(v_out); // Free memory allocated for v_out
+    deferred_free(v1);  // Free memory allocated for v1
+    deferred_free(v2);  // Free memory allocated for v2
+    deferred_free(v_out); // Free memory allocated for v_out
 }
 
 // Function definition for copying kernel arguments
 void copy_kernel_args() {
-    clSetKernelArg(kernel, 0, sizeof(int), (void *)&SZ); // Set kernel argument 0 (size)
-    clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&bufV1); // Set kernel argument 1 (bufV1)
-    clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&bufV2); // Set kernel argument 2 (bufV2)
-    clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *)&bufV_out); // Set kernel argument 3 (bufV_out)
+    set_kernel_arg(kernel, 0, sizeof(int), (void *)&SZ); // Set kernel argument 0 (size)
+    set_kernel_arg(kernel, 1, sizeof(cl_mem), (void *)&bufV1); // Set kernel argument 1 (bufV1)
+    set_kernel_arg(kernel, 2, sizeof(cl_mem), (void *)&bufV2); // Set kernel argument 2 (bufV2)
+    set_kernel_arg(kernel, 3, sizeof(cl_mem), (void *)&bufV_out); // Set kernel argument 3 (bufV_out)
 
     if (err < 0) {
         perror("Couldn't create a kernel argument"); // Print error message if failed to create kernel argument
@@ -129,51 +729,257 @@ void copy_kernel_args() {
 
 // Function definition for setting up OpenCL memory buffers
 void setup_kernel_memory() {
-    // Create OpenCL memory buffers for v1, v2, and v_out
-    bufV1 = clCreateBuffer(context, CL_MEM_READ_WRITE, SZ * sizeof(int), NULL, NULL);
-    bufV2 = clCreateBuffer(context, CL_MEM_READ_WRITE, SZ * sizeof(int), NULL, NULL);
-    bufV_out = clCreateBuffer(context, CL_MEM_READ_WRITE, SZ * sizeof(int), NULL, NULL);
+    // Wrap v1, v2, and v_out for the device backend, which registers them with the device memory manager
+    dev_v1 = device_backend.wrap(v1, SZ);
+    dev_v2 = device_backend.wrap(v2, SZ);
+    dev_v_out = device_backend.wrap(v_out, SZ);
 
-    // Write data from host to device memory buffers
-    clEnqueueWriteBuffer(queue, bufV1, CL_TRUE, 0, SZ * sizeof(int), &v1[0], 0, NULL, NULL);
-    clEnqueueWriteBuffer(queue, bufV2, CL_TRUE, 0, SZ * sizeof(int), &v2[0], 0, NULL, NULL);
+    // Write the inputs from host to device memory; v_out gets its buffer when the add writes it
+    begin_managed_op();
+    device_backend.upload(dev_v1, v1, SZ);
+    device_backend.upload(dev_v2, v2, SZ);
 }
 
 // Function definition for setting up OpenCL device, context, queue, and kernel
 void setup_openCL_device_context_queue_kernel(char *filename, char *kernelname) {
     device_id = create_device(); // Create OpenCL device
+    open_device(filename, kernelname);
+}
+
+// Function definition for creating the context, program, queue pool and kernel on device_id
+void open_device(const char *filename, const char *kernelname) {
     cl_int err;
+    program_file = filename;
+    add_kernel_name = kernelname;
 
+    auto start = std::chrono::high_resolution_clock::now();
     context = clCreateContext(NULL, 1, &device_id, NULL, NULL, &err); // Create OpenCL context
+    record_startup("clCreateContext", start);
     if (err < 0) {
         perror("Couldn't create a context"); // Print error message if failed to create context
         exit(1); // Exit program with error code 1
     }
 
-    program = build_program(context, device_id, filename); // Build OpenCL program from source
+    char options[64];
+    sprintf(options, "-D SEG_CHUNK=%d", SEG_CHUNK); // Constants shared by the host and the kernels
 
-    // Create OpenCL command queue
-    queue = clCreateCommandQueueWithProperties(context, device_id, 0, &err);
-    if (err < 0) {
-        perror("Couldn't create a command queue"); // Print error message if failed to create command queue
-        exit(1); // Exit program with error code 1
+    program = NULL;
+    if (FAST_START) {
+        program = load_program_binary(context, device_id, filename, options); // Reuse the binary from an earlier run
+    }
+    if (program == NULL) {
+        program = build_program(context, device_id, filename, options); // Build OpenCL program from source
+        if (FAST_START) {
+            save_program_binary(program, device_id, filename, options);
+        }
     }
 
-    kernel = clCreateKernel(program, kernelname, &err); // Create OpenCL kernel
-    if (err < 0) {
-        perror("Couldn't create a kernel"); // Print error message if failed to create kernel
-        printf("error =%d", err); // Print error code
-        exit(1); // Exit program with error code 1
+    // Create the pool of OpenCL command queues
+    start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < NUM_QUEUES; i++) {
+        queue_pool[i] = clCreateCommandQueueWithProperties(context, device_id, 0, &err);
+        if (err < 0) {
+            perror("Couldn't create a command queue"); // Print error message if failed to create command queue
+            exit(1); // Exit program with error code 1
+        }
+        queue_load[i] = 0;
+    }
+    queue = queue_pool[0];
+    record_startup("clCreateCommandQueueWithProperties", start);
+
+    kernel = get_kernel(kernelname); // Create OpenCL kernel, shared with the device backend's add through the kernel cache
+}
+
+// Function definition for releasing the kernels, queues, program and context of device_id. Device buffers must be
+// released or evicted first.
+void close_device() {
+    for (int i = 0; i < num_cached_kernels; i++) {
+        clReleaseKernel(kernel_cache[i]);
+    }
+    for (int i = 0; i < num_stencils; i++) {
+        clReleaseKernel(stencil_cache[i].kernel);
+        clReleaseProgram(stencil_cache[i].program);
+    }
+    for (int i = 0; i < NUM_QUEUES; i++) {
+        clReleaseCommandQueue(queue_pool[i]);
+    }
+    if (profiling_queue != NULL) {
+        clReleaseCommandQueue(profiling_queue);
+        profiling_queue = NULL;
+    }
+    clReleaseProgram(program);
+    clReleaseContext(context);
+
+    // Everything cached for the device goes with it
+    num_cached_kernels = 0;
+    num_arg_caches = 0;
+    num_stencils = 0;
+    next_stencil = 0;
+    device_budget = 0;
+    math_calibrated = false;
+}
+
+// Function definition for moving to another device: managed vectors are written back to the host and their
+// buffers released, then the old device is closed and the new one opened with the same program and add kernel.
+// The vectors are uploaded to the new device as the next op acquires them.
+void switch_device(cl_device_id dev) {
+    if (dev == NULL || dev == device_id) {
+        return;
+    }
+    for (int v = 0; v < MAX_MANAGED; v++) {
+        if (managed[v].mem != NULL) {
+            sync_vector(v);
+            tracked_clReleaseMemObject(managed[v].mem);
+            managed[v].mem = NULL;
+        }
+    }
+    bufV1 = NULL;
+    bufV2 = NULL;
+    bufV_out = NULL;
+    reclaim_drain(); // Releases still queued belong to the old context
+
+    close_device();
+    device_id = dev;
+    open_device(program_file, add_kernel_name);
+}
+
+// Function definition for the host-device traffic of an op in bytes, 0 for ops that are not routed between devices
+size_t op_transfer_bytes(const char *op) {
+    for (const op_traffic &t : op_traffic_table) {
+        if (strcmp(t.name, op) == 0) {
+            return (size_t)t.vectors * SZ * sizeof(int);
+        }
+    }
+    return 0;
+}
+
+// Function definition for the bytes of managed vectors resident on the device
+size_t resident_bytes() {
+    size_t bytes = 0;
+    for (int v = 0; v < MAX_MANAGED; v++) {
+        if (managed[v].mem != NULL) {
+            bytes += managed[v].bytes;
+        }
+    }
+    return bytes;
+}
+
+// Function definition for choosing a pool queue for a command of the given size
+int next_queue(size_t work) {
+    int chosen = queue_next;
+    if (QUEUE_POLICY == QUEUE_LEAST_LOADED) {
+        // Work counts as pending until finish_queues() has drained the queue. The search starts after the queue
+        // chosen last, so ties rotate through the pool instead of always going to the same queue.
+        for (int j = 1; j < NUM_QUEUES; j++) {
+            int i = (queue_next + j) % NUM_QUEUES;
+            if (queue_load[i] < queue_load[chosen]) {
+                chosen = i;
+            }
+        }
+    }
+    queue_next = (chosen + 1) % NUM_QUEUES;
+    queue_load[chosen] += work;
+    return chosen;
+}
+
+// Function definition for splitting an NDRange across the queue pool. Writes the index of each queue used to queues
+// and returns how many. The chunks are enqueued without events, so no driver event objects are created; callers
+// wait with finish_queues().
+int enqueue_ndrange_pooled(cl_kernel k, size_t global_size, int max_parts, int *queues) {
+    int parts = max_parts;
+    if (global_size < MIN_SPLIT_ITEMS * (size_t)parts) {
+        parts = (int)(global_size / MIN_SPLIT_ITEMS); // Small ranges gain nothing from splitting
+    }
+    if (parts < 1) {
+        parts = 1;
+    }
+
+    size_t chunk = (global_size + parts - 1) / parts;
+    bool used[NUM_QUEUES] = {false};
+    for (size_t offset = 0; offset < global_size; offset += chunk) {
+        size_t size = offset + chunk < global_size ? chunk : global_size - offset;
+        int q = next_queue(size);
+        check_error(clEnqueueNDRangeKernel(queue_pool[q], k, 1, &offset, &size, NULL, 0, NULL, NULL),
+                    "Couldn't enqueue a kernel chunk");
+        clFlush(queue_pool[q]); // Submit now so the chunks start concurrently
+        used[q] = true;
+    }
+
+    int count = 0;
+    for (int q = 0; q < NUM_QUEUES; q++) {
+        if (used[q]) {
+            queues[count++] = q;
+        }
+    }
+    return count;
+}
+
+// Function definition for waiting until pool queues have drained, which clears their pending work
+void finish_queues(const int *queues, int count) {
+    for (int i = 0; i < count; i++) {
+        check_error(clFinish(queue_pool[queues[i]]), "Couldn't finish a pool queue");
+        queue_load[queues[i]] = 0;
+    }
+}
+
+// Function definition for starting a batch of independent ops. Each op calls next_batch_op() first, which points
+// queue at a pool queue of its own; run_kernel() then flushes instead of waiting, so the ops overlap. The commands
+// of one op stay in order on its queue, so blocking reads within an op still see its kernels. Ops in a batch must
+// not use each other's outputs, and their buffers should be created before the batch so nothing is evicted.
+void begin_pool_batch() {
+    pool_batch = true;
+    for (int q = 0; q < NUM_QUEUES; q++) {
+        batch_used[q] = false;
+    }
+}
+
+// Function definition for moving the next op of a batch to the pool queue chosen by the queue policy
+void next_batch_op(size_t work) {
+    int q = next_queue(work);
+    queue = queue_pool[q];
+    batch_used[q] = true;
+}
+
+// Function definition for waiting for every op of a batch and moving queue back to the first pool queue
+void end_pool_batch() {
+    int queues[NUM_QUEUES];
+    int count = 0;
+    for (int q = 0; q < NUM_QUEUES; q++) {
+        if (batch_used[q]) {
+            queues[count++] = q;
+        }
+    }
+    finish_queues(queues, count);
+    pool_batch = false;
+    queue = queue_pool[0];
+}
+
+// Function definition for timing the kernel with different queue counts
+void benchmark_queue_pool(cl_kernel k, size_t global_size) {
+    int queues[NUM_QUEUES];
+    for (int parts = 1; parts <= NUM_QUEUES; parts *= 2) {
+        double best_ms = -1;
+        for (int rep = 0; rep < 3; rep++) {
+            auto start = std::chrono::high_resolution_clock::now();
+            int count = enqueue_ndrange_pooled(k, global_size, parts, queues);
+            finish_queues(queues, count);
+            std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - start;
+            if (best_ms < 0 || t.count() < best_ms) {
+                best_ms = t.count();
+            }
+        }
+        printf("Kernel time with %d queue(s): %f ms\n", parts, best_ms);
     }
 }
 
 // Function definition for building OpenCL program from source
-cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename) {
+cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename, const char *options) {
     cl_program program;
     FILE *program_handle;
     char *program_buffer, *program_log;
     size_t program_size, log_size;
 
+    auto start = std::chrono::high_resolution_clock::now();
     program_handle = fopen(filename, "r"); // Open OpenCL kernel file for reading
     if (program_handle == NULL) {
         perror("Couldn't find the program file"); // Print error message if failed to find program file
@@ -182,55 +988,3109 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename)
     fseek(program_handle, 0, SEEK_END); // Move file pointer to end
     program_size = ftell(program_handle); // Get size of file
     rewind(program_handle); // Rewind file pointer to beginning
-    program_buffer = (char *)malloc(program_size + 1); // Allocate memory for program buffer
+    program_buffer = (char *)tracked_malloc(program_size + 1); // Allocate memory for program buffer
     program_buffer[program_size] = '\0'; // Null-terminate program buffer
     fread(program_buffer, sizeof(char), program_size, program_handle); // Read program file into program buffer
     fclose(program_handle); // Close program file
+    record_startup("build_program: read source", start);
 
     // Create OpenCL program from source
+    start = std::chrono::high_resolution_clock::now();
     program = clCreateProgramWithSource(ctx, 1, (const char **)&program_buffer, &program_size, &err);
     if (err < 0) {
         perror("Couldn't create the program"); // Print error message if failed to create program
         exit(1); // Exit program with error code 1
     }
-    free(program_buffer); // Free program buffer memory
+    tracked_free(program_buffer); // Free program buffer memory
 
     // Build OpenCL program
-    err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+    err = clBuildProgram(program, 0, NULL, options, NULL, NULL);
     if (err < 0) {
         clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size); // Get program build log size
-        program_log = (char *)malloc(log_size + 1); // Allocate memory for program build log
+        program_log = (char *)tracked_malloc(log_size + 1); // Allocate memory for program build log
         program_log[log_size] = '\0'; // Null-terminate program build log
         clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, log_size + 1, program_log, NULL); // Get program build log
         printf("%s\n", program_log); // Print program build log
-        free(program_log); // Free program build log memory
+        tracked_free(program_log); // Free program build log memory
         exit(1); // Exit program with error code 1
     }
+    record_startup("build_program: compile", start);
 
     return program; // Return OpenCL program
 }
 
+// Function definition for naming the cached binary of a program. A binary only fits the device, driver and build
+// options it was compiled with, so a hash of those goes into the name and each combination gets its own file.
+void program_binary_name(cl_device_id dev, const char *filename, const char *options, char *name, size_t name_size) {
+    char device_name[256] = "", driver_version[256] = "";
+    clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    clGetDeviceInfo(dev, CL_DRIVER_VERSION, sizeof(driver_version), driver_version, NULL);
+    device_name[sizeof(device_name) - 1] = '\0';
+    driver_version[sizeof(driver_version) - 1] = '\0';
+
+    const char *parts[3] = {device_name, driver_version, options != NULL ? options : ""};
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (int p = 0; p < 3; p++) {
+        for (const char *c = parts[p]; ; c++) {
+            hash = (hash ^ (unsigned char)*c) * 1099511628211ull; // The terminator separates the parts
+            if (*c == '\0') {
+                break;
+            }
+        }
+    }
+    snprintf(name, name_size, "%s.%016llx.bin", filename, (unsigned long long)hash);
+}
+
+// Function definition for loading a cached program binary, returns NULL when there is no usable cache
+cl_program load_program_binary(cl_context ctx, cl_device_id dev, const char *filename, const char *options) {
+    char binary_name[512];
+    struct stat source_stat, binary_stat;
+    program_binary_name(dev, filename, options, binary_name, sizeof(binary_name));
+
+    // A binary older than the source is stale
+    if (stat(filename, &source_stat) != 0 || stat(binary_name, &binary_stat) != 0 ||
+        binary_stat.st_mtime < source_stat.st_mtime) {
+        return NULL;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    FILE *handle = fopen(binary_name, "rb");
+    if (handle == NULL) {
+        return NULL;
+    }
+    size_t binary_size = (size_t)binary_stat.st_size;
+    unsigned char *binary = (unsigned char *)tracked_malloc(binary_size);
+    size_t read_size = fread(binary, 1, binary_size, handle);
+    fclose(handle);
+    record_startup("load_program_binary: read", start);
+
+    cl_program prog = NULL;
+    cl_int binary_status, err = -1;
+    start = std::chrono::high_resolution_clock::now();
+    if (read_size == binary_size) {
+        prog = clCreateProgramWithBinary(ctx, 1, &dev, &binary_size, (const unsigned char **)&binary, &binary_status, &err);
+    }
+    tracked_free(binary);
+    if (err < 0 || binary_status < 0 || clBuildProgram(prog, 1, &dev, options, NULL, NULL) < 0) {
+        if (prog != NULL) {
+            clReleaseProgram(prog); // Binary is for another device or driver, rebuild from source
+        }
+        return NULL;
+    }
+    record_startup("load_program_binary: build", start);
+
+    return prog;
+}
+
+// Function definition for caching a program binary next to its source
+void save_program_binary(cl_program prog, cl_device_id dev, const char *filename, const char *options) {
+    char binary_name[512];
+    size_t binary_size;
+    program_binary_name(dev, filename, options, binary_name, sizeof(binary_name));
+
+    if (clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, NULL) < 0 || binary_size == 0) {
+        return;
+    }
+    unsigned char *binary = (unsigned char *)tracked_malloc(binary_size);
+    if (clGetProgramInfo(prog, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binary, NULL) == CL_SUCCESS) {
+        FILE *handle = fopen(binary_name, "wb");
+        if (handle != NULL) {
+            fwrite(binary, 1, binary_size, handle);
+            fclose(handle);
+        }
+    }
+    tracked_free(binary);
+}
+
 // Function definition for creating OpenCL device
 cl_device_id create_device() {
    cl_platform_id platform;
    cl_device_id dev;
    int err;
 
+   auto start = std::chrono::high_resolution_clock::now();
    err = clGetPlatformIDs(1, &platform, NULL); // Get OpenCL platform ID
+   record_startup("clGetPlatformIDs", start);
    if(err < 0) {
       perror("Couldn't identify a platform"); // Print error message if failed to identify platform
       exit(1); // Exit program with error code 1
    } 
 
-   err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &dev, NULL); // Get OpenCL GPU device ID
-   if(err == CL_DEVICE_NOT_FOUND) {
+   // In fast start mode, query the device type that was found last time first
+   cl_device_type first_type = CL_DEVICE_TYPE_GPU;
+   bool type_cached = false;
+   FILE *cache = FAST_START ? fopen(DEVICE_CACHE_FILE, "r") : NULL;
+   if(cache != NULL) {
+      unsigned long cached_type;
+      if(fscanf(cache, "%lu", &cached_type) == 1) {
+         first_type = (cl_device_type)cached_type;
+         type_cached = true;
+      }
+      fclose(cache);
+   }
+
+   // The ranking runs unless fast start already knows the device type. A fast start run then uses the first
+   // platform's device of that type and routes no ops between devices.
+   if(DEVICE_RANKING && !type_cached) {
+      start = std::chrono::high_resolution_clock::now();
+      rank_devices(); // Probe every platform/device pair, or load the cached ranking
+      dev = select_device_for_op(3 * (size_t)SZ * sizeof(int), NULL, 0); // Two uploads and one download per add
+      record_startup("rank devices", start);
+      if(dev != NULL) {
+         cl_device_type ranked_type = CL_DEVICE_TYPE_GPU;
+         clGetDeviceInfo(dev, CL_DEVICE_TYPE, sizeof(ranked_type), &ranked_type, NULL);
+         if(FAST_START) {
+            cache = fopen(DEVICE_CACHE_FILE, "w"); // Remember the ranked device type for the next run
+            if(cache != NULL) {
+               fprintf(cache, "%lu\n", (unsigned long)ranked_type);
+               fclose(cache);
+            }
+         }
+         return dev;
+      }
+      printf("Device ranking failed, using the first GPU or CPU\n");
+   }
+
+   start = std::chrono::high_resolution_clock::now();
+   cl_device_type found_type = first_type;
+   err = clGetDeviceIDs(platform, first_type, 1, &dev, NULL); // Get OpenCL device ID of the preferred type
+   if(err == CL_DEVICE_NOT_FOUND && first_type == CL_DEVICE_TYPE_GPU) {
       printf("GPU not found\n"); // Print message if GPU not found
+      found_type = CL_DEVICE_TYPE_CPU;
       err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_CPU, 1, &dev, NULL); // Get OpenCL CPU device ID
+   } else if(err == CL_DEVICE_NOT_FOUND) {
+      found_type = CL_DEVICE_TYPE_GPU;
+      err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &dev, NULL); // Cached type is gone, try GPU
    }
+   record_startup("clGetDeviceIDs", start);
    if(err < 0) {
       perror("Couldn't access any devices"); // Print error message if failed to access any devices
       exit(1); // Exit program with error code 1
    }
 
+   if(FAST_START && found_type != first_type) {
+      cache = fopen(DEVICE_CACHE_FILE, "w"); // Remember the device type for the next run
+      if(cache != NULL) {
+         fprintf(cache, "%lu\n", (unsigned long)found_type);
+         fclose(cache);
+      }
+   }
+
    return dev; // Return OpenCL device ID
 }
+
+// Function definition for exiting on an OpenCL error
+void check_error(cl_int err, const char *message) {
+    if (err < 0) {
+        perror(message); // Print error message
+        printf("error = %d\n", err); // Print error code
+        exit(1); // Exit program with error code 1
+    }
+}
+
+// Function definition for getting a cached kernel from the program
+cl_kernel get_kernel(const char *name) {
+    for (int i = 0; i < num_cached_kernels; i++) {
+        if (strcmp(kernel_cache_names[i], name) == 0) {
+            return kernel_cache[i];
+        }
+    }
+    if (num_cached_kernels == MAX_KERNELS) {
+        printf("Kernel cache is full\n");
+        exit(1);
+    }
+
+    cl_int err;
+    cl_kernel k = clCreateKernel(program, name, &err);
+    check_error(err, "Couldn't create a kernel");
+    kernel_cache_names[num_cached_kernels] = name;
+    kernel_cache[num_cached_kernels++] = k;
+    return k;
+}
+
+// Function definition for setting a kernel argument through the argument cache: the call is skipped when the
+// kernel already holds the same value (or local size), and nothing is allocated either way
+cl_int set_kernel_arg(cl_kernel k, cl_uint index, size_t size, const void *value) {
+    kernel_arg_cache *c = NULL;
+    for (int i = 0; i < num_arg_caches; i++) {
+        if (arg_caches[i].kernel == k) {
+            c = &arg_caches[i];
+            break;
+        }
+    }
+    if (c == NULL && num_arg_caches < MAX_ARG_KERNELS) {
+        c = &arg_caches[num_arg_caches++];
+        memset(c, 0, sizeof(*c));
+        c->kernel = k;
+    }
+
+    bool local = value == NULL;
+    bool cacheable = c != NULL && index < MAX_KERNEL_ARGS && (local || size <= KERNEL_ARG_BYTES);
+    if (cacheable && c->sizes[index] == size && c->local[index] == local &&
+        (local || memcmp(c->values[index], value, size) == 0)) {
+        kernel_args_skipped++;
+        return CL_SUCCESS;
+    }
+
+    kernel_args_set++;
+    cl_int status = clSetKernelArg(k, index, size, value);
+    if (cacheable) {
+        c->sizes[index] = status == CL_SUCCESS ? size : 0;
+        c->local[index] = local;
+        if (!local && status == CL_SUCCESS) {
+            memcpy(c->values[index], value, size);
+        }
+    }
+    return status;
+}
+
+// Function definition for dropping the remembered arguments of a kernel about to be released, as a new kernel
+// could get the same handle
+void forget_kernel_args(cl_kernel k) {
+    for (int i = 0; i < num_arg_caches; i++) {
+        if (arg_caches[i].kernel == k) {
+            arg_caches[i] = arg_caches[--num_arg_caches];
+            return;
+        }
+    }
+}
+
+// Function definition for rounding a work size up to a multiple
+size_t round_up(size_t value, size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+// Function definition for running a 1D kernel to completion on the first queue
+void run_kernel(cl_kernel k, size_t global_size, size_t local_size) {
+    check_error(clEnqueueNDRangeKernel(queue, k, 1, NULL, &global_size, local_size ? &local_size : NULL, 0, NULL, NULL),
+                "Couldn't enqueue a kernel");
+    check_error(pool_batch ? clFlush(queue) : clFinish(queue), "Couldn't finish a kernel"); // Batched ops are waited for together
+}
+
+// Function definition for gathering on the device: out[i] = src[idx[i]]
+void gather_ocl(cl_mem idx, cl_mem src, cl_mem out, int size) {
+    cl_kernel k = get_kernel("gather_ocl");
+    set_kernel_arg(k, 0, sizeof(int), &size);
+    set_kernel_arg(k, 1, sizeof(cl_mem), &idx);
+    set_kernel_arg(k, 2, sizeof(cl_mem), &src);
+    set_kernel_arg(k, 3, sizeof(cl_mem), &out);
+    run_kernel(k, round_up(size, OP_LOCAL_SIZE), OP_LOCAL_SIZE);
+}
+
+// Function definition for scattering on the device: out[idx[i]] = values[i]
+void scatter_ocl(cl_mem idx, cl_mem values, cl_mem out, int size) {
+    cl_kernel k = get_kernel("scatter_ocl");
+    set_kernel_arg(k, 0, sizeof(int), &size);
+    set_kernel_arg(k, 1, sizeof(cl_mem), &idx);
+    set_kernel_arg(k, 2, sizeof(cl_mem), &values);
+    set_kernel_arg(k, 3, sizeof(cl_mem), &out);
+    run_kernel(k, round_up(size, OP_LOCAL_SIZE), OP_LOCAL_SIZE);
+}
+
+// Function definition for estimating how often scatter indices repeat, from a sample read off the device
+double measure_collision_rate(cl_mem idx, int size) {
+    int sample_size = size < COLLISION_SAMPLE ? size : COLLISION_SAMPLE;
+    if (sample_size == 0) {
+        return 0;
+    }
+    int *sample = (int *)tracked_malloc(sizeof(int) * sample_size);
+    check_error(clEnqueueReadBuffer(queue, idx, CL_TRUE, 0, sizeof(int) * sample_size, sample, 0, NULL, NULL),
+                "Couldn't read the index sample");
+
+    // Count repeated indices with an open-addressing set twice the sample size
+    int table_size = 2 * COLLISION_SAMPLE;
+    int *table = (int *)tracked_malloc(sizeof(int) * table_size);
+    for (int i = 0; i < table_size; i++) {
+        table[i] = -1;
+    }
+    int repeats = 0;
+    for (int i = 0; i < sample_size; i++) {
+        unsigned slot = ((unsigned)sample[i] * 2654435761u) % table_size;
+        while (table[slot] != -1 && table[slot] != sample[i]) {
+            slot = (slot + 1) % table_size;
+        }
+        if (table[slot] == sample[i]) {
+            repeats++;
+        }
+        table[slot] = sample[i];
+    }
+
+    tracked_free(table);
+    tracked_free(sample);
+    return (double)repeats / sample_size;
+}
+
+// Function definition for scatter-add on the device: out[idx[i]] += values[i]
+void scatter_add_ocl(cl_mem idx, cl_mem values, cl_mem out, int size, int out_size) {
+    // Privatized atomics whenever out fits in local memory
+    if (fits_local_memory(sizeof(int) * out_size)) {
+        printf("scatter-add: local memory privatized atomics\n");
+        cl_kernel k = get_kernel("scatter_add_local_ocl");
+        set_kernel_arg(k, 0, sizeof(int), &size);
+        set_kernel_arg(k, 1, sizeof(cl_mem), &idx);
+        set_kernel_arg(k, 2, sizeof(cl_mem), &values);
+        set_kernel_arg(k, 3, sizeof(cl_mem), &out);
+        set_kernel_arg(k, 4, sizeof(int), &out_size);
+        set_kernel_arg(k, 5, sizeof(int) * out_size, NULL);
+        run_kernel(k, privatized_global_size(), OP_LOCAL_SIZE);
+        return;
+    }
+
+    double collision_rate = measure_collision_rate(idx, size);
+    if (collision_rate < SORT_COLLISION_RATE) {
+        printf("scatter-add: global atomics (collision rate %.2f)\n", collision_rate);
+        cl_kernel k = get_kernel("scatter_add_global_ocl");
+        set_kernel_arg(k, 0, sizeof(int), &size);
+        set_kernel_arg(k, 1, sizeof(cl_mem), &idx);
+        set_kernel_arg(k, 2, sizeof(cl_mem), &values);
+        set_kernel_arg(k, 3, sizeof(cl_mem), &out);
+        run_kernel(k, round_up(size, OP_LOCAL_SIZE), OP_LOCAL_SIZE);
+        return;
+    }
+
+    // Heavy collisions on a large output: sort by index, then reduce each run of equal indices
+    printf("scatter-add: sort by key and segmented reduce (collision rate %.2f)\n", collision_rate);
+    cl_int err;
+    cl_mem keys = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * size, NULL, &err);
+    check_error(err, "Couldn't create the sort keys");
+    cl_mem sorted_values = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * size, NULL, &err);
+    check_error(err, "Couldn't create the sort values");
+    clEnqueueCopyBuffer(queue, idx, keys, 0, 0, sizeof(int) * size, 0, NULL, NULL);
+    clEnqueueCopyBuffer(queue, values, sorted_values, 0, 0, sizeof(int) * size, 0, NULL, NULL);
+    radix_sort_ocl(keys, sorted_values, size, false);
+
+    cl_kernel k = get_kernel("segmented_reduce_ocl");
+    set_kernel_arg(k, 0, sizeof(int), &size);
+    set_kernel_arg(k, 1, sizeof(cl_mem), &keys);
+    set_kernel_arg(k, 2, sizeof(cl_mem), &sorted_values);
+    set_kernel_arg(k, 3, sizeof(cl_mem), &out);
+    run_kernel(k, round_up((size + SEG_CHUNK - 1) / SEG_CHUNK, OP_LOCAL_SIZE), OP_LOCAL_SIZE);
+
+    tracked_clReleaseMemObject(keys);
+    tracked_clReleaseMemObject(sorted_values);
+}
+
+// Function definition for counting the bins of a scatter result that the host would not produce: a hit bin must
+// hold one of the values scattered to it, a bin nothing was scattered to must still be 0
+long scatter_mismatches(const int *out, const int *idx, const int *values, int size, int out_size) {
+    char *state = (char *)tracked_malloc(out_size); // 0: not hit, 1: hit, 2: holds one of its values
+    memset(state, 0, out_size);
+    for (long i = 0; i < size; i++) {
+        if (out[idx[i]] == values[i]) {
+            state[idx[i]] = 2;
+        } else if (state[idx[i]] == 0) {
+            state[idx[i]] = 1;
+        }
+    }
+    long mismatches = 0;
+    for (int b = 0; b < out_size; b++) {
+        mismatches += state[b] == 1 || (state[b] == 0 && out[b] != 0);
+    }
+    tracked_free(state);
+    return mismatches;
+}
+
+// Function definition for running scatter-add of v2 at the given indices into a zeroed output and counting the
+// bins that differ from the host result
+long scatter_add_mismatches(cl_mem idx, const int *host_idx, int size, int out_size) {
+    cl_int err;
+    int zero = 0;
+    cl_mem out = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * out_size, NULL, &err);
+    check_error(err, "Couldn't create the scatter-add output");
+    check_error(clEnqueueFillBuffer(queue, out, &zero, sizeof(int), 0, sizeof(int) * out_size, 0, NULL, NULL),
+                "Couldn't clear the scatter-add output");
+    scatter_add_ocl(idx, bufV2, out, size, out_size);
+
+    int *result = (int *)tracked_malloc(sizeof(int) * out_size);
+    int *expected = (int *)tracked_malloc(sizeof(int) * out_size);
+    check_error(clEnqueueReadBuffer(queue, out, CL_TRUE, 0, sizeof(int) * out_size, result, 0, NULL, NULL),
+                "Couldn't read the scatter-add output");
+    memset(expected, 0, sizeof(int) * out_size);
+    for (long i = 0; i < size; i++) {
+        expected[host_idx[i]] += v2[i];
+    }
+    long mismatches = 0;
+    for (int b = 0; b < out_size; b++) {
+        mismatches += result[b] != expected[b];
+    }
+
+    tracked_free(expected);
+    tracked_free(result);
+    deferred_release(out);
+    return mismatches;
+}
+
+// Function definition for checking whether a private copy fits in local memory, leaving half for the runtime
+bool fits_local_memory(size_t bytes) {
+    cl_ulong local_mem = 0;
+    clGetDeviceInfo(device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+    return bytes <= local_mem / 2;
+}
+
+// Function definition for getting the global size of grid-stride privatized kernels
+size_t privatized_global_size() {
+    cl_uint compute_units = 1;
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+    return (size_t)compute_units * 4 * OP_LOCAL_SIZE; // A few work-groups per compute unit, each merging once
+}
+
+// Function definition for histogramming on the device, values outside [min_value, min_value + num_bins) are ignored
+void histogram_ocl(cl_mem data, int size, cl_mem hist, int num_bins, int min_value) {
+    int zero = 0;
+    clEnqueueFillBuffer(queue, hist, &zero, sizeof(int), 0, sizeof(int) * num_bins, 0, NULL, NULL);
+
+    if (fits_local_memory(sizeof(int) * num_bins)) {
+        cl_kernel k = get_kernel("histogram_local_ocl");
+        set_kernel_arg(k, 0, sizeof(int), &size);
+        set_kernel_arg(k, 1, sizeof(cl_mem), &data);
+        set_kernel_arg(k, 2, sizeof(cl_mem), &hist);
+        set_kernel_arg(k, 3, sizeof(int), &num_bins);
+        set_kernel_arg(k, 4, sizeof(int), &min_value);
+        set_kernel_arg(k, 5, sizeof(int) * num_bins, NULL);
+        run_kernel(k, privatized_global_size(), OP_LOCAL_SIZE);
+    } else {
+        // Too many bins for local memory, spill to global atomics
+        cl_kernel k = get_kernel("histogram_global_ocl");
+        set_kernel_arg(k, 0, sizeof(int), &size);
+        set_kernel_arg(k, 1, sizeof(cl_mem), &data);
+        set_kernel_arg(k, 2, sizeof(cl_mem), &hist);
+        set_kernel_arg(k, 3, sizeof(int), &num_bins);
+        set_kernel_arg(k, 4, sizeof(int), &min_value);
+        run_kernel(k, round_up(size, OP_LOCAL_SIZE), OP_LOCAL_SIZE);
+    }
+}
+
+// Function definition for getting the number of host threads
+int host_threads() {
+    int threads = (int)std::thread::hardware_concurrency();
+    return threads > 0 ? threads : 1;
+}
+
+// Function definition for histogramming on the host, one private histogram per thread
+void histogram_host(const int *data, int size, int *hist, int num_bins, int min_value) {
+    int threads = host_threads();
+    int *partial = (int *)tracked_malloc(sizeof(int) * threads * num_bins);
+    memset(partial, 0, sizeof(int) * threads * num_bins);
+    std::thread *workers = new std::thread[threads];
+
+    for (int t = 0; t < threads; t++) {
+        workers[t] = std::thread([=]() {
+            long begin = (long)size * t / threads;
+            long end = (long)size * (t + 1) / threads;
+            int *mine = partial + (size_t)t * num_bins;
+            for (long i = begin; i < end; i++) {
+                int bin = data[i] - min_value;
+                if (bin >= 0 && bin < num_bins) {
+                    mine[bin]++;
+                }
+            }
+        });
+    }
+    for (int t = 0; t < threads; t++) {
+        workers[t].join();
+    }
+
+    for (int b = 0; b < num_bins; b++) {
+        hist[b] = 0;
+        for (int t = 0; t < threads; t++) {
+            hist[b] += partial[(size_t)t * num_bins + b];
+        }
+    }
+    delete[] workers;
+    tracked_free(partial);
+}
+
+// Function definition for an in-place exclusive scan on the device
+void exclusive_scan_ocl(cl_mem data, int size) {
+    int num_blocks = (size + OP_LOCAL_SIZE - 1) / OP_LOCAL_SIZE;
+    cl_int err;
+    cl_mem block_sums = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * num_blocks, NULL, &err);
+    check_error(err, "Couldn't create the scan block sums");
+
+    cl_kernel k = get_kernel("scan_block_ocl");
+    set_kernel_arg(k, 0, sizeof(int), &size);
+    set_kernel_arg(k, 1, sizeof(cl_mem), &data);
+    set_kernel_arg(k, 2, sizeof(cl_mem), &block_sums);
+    set_kernel_arg(k, 3, sizeof(int) * OP_LOCAL_SIZE, NULL);
+    run_kernel(k, (size_t)num_blocks * OP_LOCAL_SIZE, OP_LOCAL_SIZE);
+
+    // Scan the block totals the same way, then add them back into every block
+    if (num_blocks > 1) {
+        exclusive_scan_ocl(block_sums, num_blocks);
+        k = get_kernel("scan_add_ocl");
+        set_kernel_arg(k, 0, sizeof(int), &size);
+        set_kernel_arg(k, 1, sizeof(cl_mem), &data);
+        set_kernel_arg(k, 2, sizeof(cl_mem), &block_sums);
+        run_kernel(k, (size_t)num_blocks * OP_LOCAL_SIZE, OP_LOCAL_SIZE);
+    }
+    tracked_clReleaseMemObject(block_sums);
+}
+
+// Function definition for a stable LSD radix sort of int (or long when wide_keys) keys on the device, values may be NULL
+void radix_sort_ocl(cl_mem keys, cl_mem values, int size, bool wide_keys) {
+    size_t key_size = wide_keys ? sizeof(cl_long) : sizeof(int);
+    int passes = (int)(key_size * 8 / RADIX_BITS); // Always even, so the result ends in keys and values
+    int num_items = (size + RADIX_ITEMS - 1) / RADIX_ITEMS;
+    cl_int err;
+
+    cl_mem counts = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * RADIX_BUCKETS * num_items, NULL, &err);
+    check_error(err, "Couldn't create the radix counts");
+    cl_mem tmp_keys = create_buffer_spilling(CL_MEM_READ_WRITE, key_size * size, NULL, &err);
+    check_error(err, "Couldn't create the radix keys");
+    cl_mem tmp_values = NULL;
+    if (values != NULL) {
+        tmp_values = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * size, NULL, &err);
+        check_error(err, "Couldn't create the radix values");
+    }
+
+    cl_kernel count = get_kernel(wide_keys ? "radix_count_long" : "radix_count_int");
+    cl_kernel scatter = get_kernel(wide_keys ? "radix_scatter_long" : "radix_scatter_int");
+    cl_mem keys_in = keys, keys_out = tmp_keys, values_in = values, values_out = tmp_values;
+    size_t global_size = round_up(num_items, OP_LOCAL_SIZE);
+
+    for (int pass = 0; pass < passes; pass++) {
+        int shift = pass * RADIX_BITS;
+
+        // Per work-item digit histogram, scanned into stable output offsets
+        set_kernel_arg(count, 0, sizeof(int), &size);
+        set_kernel_arg(count, 1, sizeof(cl_mem), &keys_in);
+        set_kernel_arg(count, 2, sizeof(cl_mem), &counts);
+        set_kernel_arg(count, 3, sizeof(int), &shift);
+        set_kernel_arg(count, 4, sizeof(int), &num_items);
+        run_kernel(count, global_size, OP_LOCAL_SIZE);
+        exclusive_scan_ocl(counts, RADIX_BUCKETS * num_items);
+
+        set_kernel_arg(scatter, 0, sizeof(int), &size);
+        set_kernel_arg(scatter, 1, sizeof(cl_mem), &keys_in);
+        set_kernel_arg(scatter, 2, sizeof(cl_mem), &keys_out);
+        set_kernel_arg(scatter, 3, sizeof(cl_mem), values_in != NULL ? &values_in : NULL);
+        set_kernel_arg(scatter, 4, sizeof(cl_mem), values_out != NULL ? &values_out : NULL);
+        set_kernel_arg(scatter, 5, sizeof(cl_mem), &counts);
+        set_kernel_arg(scatter, 6, sizeof(int), &shift);
+        set_kernel_arg(scatter, 7, sizeof(int), &num_items);
+        run_kernel(scatter, global_size, OP_LOCAL_SIZE);
+
+        cl_mem swap = keys_in; keys_in = keys_out; keys_out = swap;
+        swap = values_in; values_in = values_out; values_out = swap;
+    }
+
+    tracked_clReleaseMemObject(counts);
+    tracked_clReleaseMemObject(tmp_keys);
+    if (tmp_values != NULL) {
+        tracked_clReleaseMemObject(tmp_values);
+    }
+}
+
+// Function definition for a stable parallel LSD radix sort on the host, values may be NULL
+template <typename Key> void radix_sort_host(Key *keys, int *values, int size) {
+    const int buckets = 1 << HOST_RADIX_BITS;
+    const int passes = (int)(sizeof(Key) * 8 / HOST_RADIX_BITS); // Always even, so the result ends in keys and values
+    typedef typename std::make_unsigned<Key>::type UKey;
+    const UKey sign = (UKey)1 << (sizeof(Key) * 8 - 1);         // Flipped so negative keys sort first
+    int threads = host_threads();
+    Key *tmp_keys = (Key *)tracked_malloc(sizeof(Key) * size);
+    int *tmp_values = values != NULL ? (int *)tracked_malloc(sizeof(int) * size) : NULL;
+    long *offsets = (long *)tracked_malloc(sizeof(long) * buckets * threads);
+    std::thread *workers = new std::thread[threads];
+
+    Key *keys_in = keys, *keys_out = tmp_keys;
+    int *values_in = values, *values_out = tmp_values;
+    for (int pass = 0; pass < passes; pass++) {
+        int shift = pass * HOST_RADIX_BITS;
+        auto digit = [=](Key key) { return (int)((((UKey)key ^ sign) >> shift) & (buckets - 1)); };
+
+        // Each thread counts the digits of its own contiguous chunk
+        for (int t = 0; t < threads; t++) {
+            workers[t] = std::thread([=]() {
+                long *mine = offsets + (size_t)t * buckets;
+                for (int d = 0; d < buckets; d++) {
+                    mine[d] = 0;
+                }
+                for (long i = (long)size * t / threads; i < (long)size * (t + 1) / threads; i++) {
+                    mine[digit(keys_in[i])]++;
+                }
+            });
+        }
+        for (int t = 0; t < threads; t++) {
+            workers[t].join();
+        }
+
+        // Digit-major, then thread order keeps the sort stable
+        long running = 0;
+        for (int d = 0; d < buckets; d++) {
+            for (int t = 0; t < threads; t++) {
+                long count = offsets[(size_t)t * buckets + d];
+                offsets[(size_t)t * buckets + d] = running;
+                running += count;
+            }
+        }
+
+        for (int t = 0; t < threads; t++) {
+            workers[t] = std::thread([=]() {
+                long *mine = offsets + (size_t)t * buckets;
+                for (long i = (long)size * t / threads; i < (long)size * (t + 1) / threads; i++) {
+                    long pos = mine[digit(keys_in[i])]++;
+                    keys_out[pos] = keys_in[i];
+                    if (values_in != NULL) {
+                        values_out[pos] = values_in[i];
+                    }
+                }
+            });
+        }
+        for (int t = 0; t < threads; t++) {
+            workers[t].join();
+        }
+
+        Key *swap_keys = keys_in; keys_in = keys_out; keys_out = swap_keys;
+        int *swap_values = values_in; values_in = values_out; values_out = swap_values;
+    }
+
+    delete[] workers;
+    tracked_free(offsets);
+    tracked_free(tmp_keys);
+    tracked_free(tmp_values);
+}
+
+// Function definition for finding the k largest values on the device, written to result in descending order
+void topk_ocl(cl_mem data, int size, int k, int *result) {
+    if (k < 1 || k > TOPK_MAX || k > size) {
+        printf("topk: k must be between 1 and %d and at most the vector size\n", TOPK_MAX);
+        exit(1);
+    }
+    const int tile_size = 2 * OP_LOCAL_SIZE;
+    cl_kernel kern = get_kernel("topk_local_ocl");
+    cl_mem input = data;
+    cl_int err;
+
+    // Each round keeps the top k of every tile, until a single tile holds all candidates
+    do {
+        int groups = (size + tile_size - 1) / tile_size;
+        cl_mem candidates = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * groups * k, NULL, &err);
+        check_error(err, "Couldn't create the top-k candidates");
+        set_kernel_arg(kern, 0, sizeof(int), &size);
+        set_kernel_arg(kern, 1, sizeof(cl_mem), &input);
+        set_kernel_arg(kern, 2, sizeof(int), &k);
+        set_kernel_arg(kern, 3, sizeof(cl_mem), &candidates);
+        set_kernel_arg(kern, 4, sizeof(int) * tile_size, NULL);
+        run_kernel(kern, (size_t)groups * OP_LOCAL_SIZE, OP_LOCAL_SIZE);
+
+        if (input != data) {
+            tracked_clReleaseMemObject(input);
+        }
+        input = candidates;
+        size = groups * k;
+    } while (size > k);
+
+    clEnqueueReadBuffer(queue, input, CL_TRUE, 0, sizeof(int) * k, result, 0, NULL, NULL);
+    tracked_clReleaseMemObject(input);
+}
+
+// Function definition for counting the values above a threshold on the device
+int count_above_ocl(cl_mem data, int size, int threshold) {
+    int count = 0;
+    cl_int err;
+    cl_mem bufCount = create_buffer_spilling(CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(int), &count, &err);
+    check_error(err, "Couldn't create the count");
+
+    cl_kernel k = get_kernel("count_above_ocl");
+    set_kernel_arg(k, 0, sizeof(int), &size);
+    set_kernel_arg(k, 1, sizeof(cl_mem), &data);
+    set_kernel_arg(k, 2, sizeof(int), &threshold);
+    set_kernel_arg(k, 3, sizeof(cl_mem), &bufCount);
+    set_kernel_arg(k, 4, sizeof(int), NULL);
+    run_kernel(k, privatized_global_size(), OP_LOCAL_SIZE);
+
+    clEnqueueReadBuffer(queue, bufCount, CL_TRUE, 0, sizeof(int), &count, 0, NULL, NULL);
+    tracked_clReleaseMemObject(bufCount);
+    return count;
+}
+
+// Function definition for compacting the values above a threshold into out on the device, returns how many were written
+int select_above_ocl(cl_mem data, int size, int threshold, cl_mem out) {
+    int count = 0;
+    cl_int err;
+    cl_mem bufCount = create_buffer_spilling(CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(int), &count, &err);
+    check_error(err, "Couldn't create the count");
+
+    cl_kernel k = get_kernel("select_above_ocl");
+    set_kernel_arg(k, 0, sizeof(int), &size);
+    set_kernel_arg(k, 1, sizeof(cl_mem), &data);
+    set_kernel_arg(k, 2, sizeof(int), &threshold);
+    set_kernel_arg(k, 3, sizeof(cl_mem), &out);
+    set_kernel_arg(k, 4, sizeof(cl_mem), &bufCount);
+    set_kernel_arg(k, 5, sizeof(int) * 2, NULL);
+    run_kernel(k, round_up(size, OP_LOCAL_SIZE), OP_LOCAL_SIZE);
+
+    clEnqueueReadBuffer(queue, bufCount, CL_TRUE, 0, sizeof(int), &count, 0, NULL, NULL);
+    tracked_clReleaseMemObject(bufCount);
+    return count;
+}
+
+// Function definition for getting the number of bits needed for a value
+int bit_width(unsigned value) {
+    return value == 0 ? 0 : 32 - __builtin_clz(value);
+}
+
+// Function definition for splitting [0, count) into one contiguous range per host thread
+void parallel_for(int count, void (*body)(int begin, int end, void *arg), void *arg) {
+    int threads = host_threads();
+    std::thread *workers = new std::thread[threads];
+    for (int t = 0; t < threads; t++) {
+        workers[t] = std::thread(body, (int)((long)count * t / threads), (int)((long)count * (t + 1) / threads), arg);
+    }
+    for (int t = 0; t < threads; t++) {
+        workers[t].join();
+    }
+    delete[] workers;
+}
+
+// Arguments shared by the pack_host() worker passes
+struct pack_args {
+    const int *data;
+    int size;
+    int *headers;
+    unsigned *words;
+};
+
+// Function definition for bit-packing a vector on the host with frame-of-reference chunks of CODEC_CHUNK values.
+// headers receives (base, bits, first word) for each chunk, words is allocated here; returns the number of words.
+size_t pack_host(const int *data, int size, int *headers, unsigned **words) {
+    int num_chunks = (size + CODEC_CHUNK - 1) / CODEC_CHUNK;
+    pack_args args = {data, size, headers, NULL};
+
+    // First pass: base and bit width of every chunk
+    parallel_for(num_chunks, [](int begin, int end, void *arg) {
+        pack_args *a = (pack_args *)arg;
+        for (int c = begin; c < end; c++) {
+            int lo = a->data[(long)c * CODEC_CHUNK], hi = lo;
+            long last = (long)(c + 1) * CODEC_CHUNK < a->size ? (long)(c + 1) * CODEC_CHUNK : a->size;
+            for (long i = (long)c * CODEC_CHUNK; i < last; i++) {
+                lo = a->data[i] < lo ? a->data[i] : lo;
+                hi = a->data[i] > hi ? a->data[i] : hi;
+            }
+            a->headers[3 * c] = lo;
+            a->headers[3 * c + 1] = bit_width((unsigned)hi - (unsigned)lo);
+        }
+    }, &args);
+
+    // Word offsets are a prefix sum of the chunk sizes
+    size_t num_words = 0;
+    for (int c = 0; c < num_chunks; c++) {
+        headers[3 * c + 2] = (int)num_words;
+        num_words += ((size_t)CODEC_CHUNK * headers[3 * c + 1] + 31) / 32;
+    }
+    *words = (unsigned *)tracked_malloc(sizeof(unsigned) * (num_words + 1));
+    (*words)[num_words] = 0;
+    args.words = *words;
+
+    // Second pass: pack each chunk into its own words
+    parallel_for(num_chunks, [](int begin, int end, void *arg) {
+        pack_args *a = (pack_args *)arg;
+        for (int c = begin; c < end; c++) {
+            int base = a->headers[3 * c], bits = a->headers[3 * c + 1];
+            unsigned *out = a->words + a->headers[3 * c + 2];
+            long first = (long)c * CODEC_CHUNK;
+            long last = first + CODEC_CHUNK < a->size ? first + CODEC_CHUNK : a->size;
+            uint64_t acc = 0;
+            int acc_bits = 0;
+            for (long i = first; i < last && bits > 0; i++) {
+                acc |= (uint64_t)((unsigned)a->data[i] - (unsigned)base) << acc_bits;
+                acc_bits += bits;
+                if (acc_bits >= 32) {
+                    *out++ = (unsigned)acc;
+                    acc >>= 32;
+                    acc_bits -= 32;
+                }
+            }
+            if (acc_bits > 0) {
+                *out = (unsigned)acc; // Partial last word of the chunk
+            }
+        }
+    }, &args);
+
+    return num_words;
+}
+
+// Arguments shared by the unpack_host() workers
+struct unpack_args {
+    const unsigned *words;
+    int bits;
+    const int *bases;
+    int *out;
+};
+
+// Function definition for unpacking a vector packed with one bit width and a base per CODEC_CHUNK values
+void unpack_host(const unsigned *words, int size, int bits, const int *bases, int *out) {
+    unpack_args args = {words, bits, bases, out};
+    parallel_for(size, [](int begin, int end, void *arg) {
+        unpack_args *a = (unpack_args *)arg;
+        uint64_t mask = ((uint64_t)1 << a->bits) - 1;
+        for (long i = begin; i < end; i++) {
+            uint64_t bit = (uint64_t)i * a->bits;
+            uint64_t pair = a->words[bit / 32];
+            if (bit % 32 + a->bits > 32) {
+                pair |= (uint64_t)a->words[bit / 32 + 1] << 32;
+            }
+            a->out[i] = a->bases[i / CODEC_CHUNK] + (int)((pair >> (bit % 32)) & mask);
+        }
+    }, &args);
+}
+
+// Function definition for running a 2D kernel over a matrix to completion on the first queue
+void run_kernel_2d(cl_kernel k, size_t cols, size_t rows) {
+    size_t global_size[2] = {round_up(cols, MATRIX_TILE), round_up(rows, MATRIX_TILE)};
+    size_t local_size[2] = {MATRIX_TILE, MATRIX_TILE};
+    check_error(clEnqueueNDRangeKernel(queue, k, 2, NULL, global_size, local_size, 0, NULL, NULL), "Couldn't enqueue a kernel");
+    check_error(pool_batch ? clFlush(queue) : clFinish(queue), "Couldn't finish a kernel"); // Batched ops are waited for together
+}
+
+// Function definition for viewing a vector of the given size as a near-square matrix
+void matrix_shape(int size, int *rows, int *cols) {
+    *cols = (int)sqrt((double)size);
+    *cols = *cols > 0 ? *cols : 1;
+    *rows = size / *cols;
+}
+
+// Function definition for getting the bytes per element of a storage type
+size_t storage_size(storage_type type) {
+    return type == STORAGE_F32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+// Function definition for adding float vectors stored as the given type on the device
+void vector_add_float_ocl(cl_mem a, cl_mem b, cl_mem out, int size, storage_type type) {
+    cl_kernel k = get_kernel(type == STORAGE_F32 ? "vector_add_f32" : type == STORAGE_F16 ? "vector_add_f16" : "vector_add_bf16");
+    set_kernel_arg(k, 0, sizeof(int), &size);
+    set_kernel_arg(k, 1, sizeof(cl_mem), &a);
+    set_kernel_arg(k, 2, sizeof(cl_mem), &b);
+    set_kernel_arg(k, 3, sizeof(cl_mem), &out);
+    run_kernel(k, round_up(size, OP_LOCAL_SIZE), OP_LOCAL_SIZE);
+}
+
+// Function definition for adding float matrices stored as the given type on the device, ld is in elements
+void matrix_add_float_ocl(cl_mem a, cl_mem b, cl_mem out, int rows, int cols, int ld, bool column_major, storage_type type) {
+    if (column_major) {
+        int swap = rows; rows = cols; cols = swap; // A column-major matrix is its row-major transpose
+    }
+    cl_kernel k = get_kernel(type == STORAGE_F32 ? "matrix_add_f32" : type == STORAGE_F16 ? "matrix_add_f16" : "matrix_add_bf16");
+    set_kernel_arg(k, 0, sizeof(int), &rows);
+    set_kernel_arg(k, 1, sizeof(int), &cols);
+    set_kernel_arg(k, 2, sizeof(int), &ld);
+    set_kernel_arg(k, 3, sizeof(cl_mem), &a);
+    set_kernel_arg(k, 4, sizeof(cl_mem), &b);
+    set_kernel_arg(k, 5, sizeof(cl_mem), &out);
+    run_kernel_2d(k, cols, rows);
+}
+
+// Function definition for converting one float to half, rounding to nearest even
+uint16_t float_to_half(float value) {
+    uint32_t x;
+    memcpy(&x, &value, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t abs_x = x & 0x7fffffff;
+
+    if (abs_x >= 0x7f800000) {
+        return sign | (abs_x > 0x7f800000 ? 0x7e00 : 0x7c00); // NaN or infinity
+    }
+    if (abs_x >= 0x477ff000) {
+        return sign | 0x7c00; // 65520 and above round to infinity
+    }
+    if (abs_x < 0x38800000) {
+        // Below the smallest normal half: subnormal result in units of 2^-24
+        if (abs_x < 0x33000000) {
+            return sign;
+        }
+        uint32_t mantissa = (abs_x & 0x7fffff) | 0x800000;
+        int shift = 126 - (int)(abs_x >> 23);
+        uint32_t h = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        h += rest > halfway || (rest == halfway && (h & 1));
+        return sign | h;
+    }
+    uint32_t h = (abs_x - 0x38000000) >> 13; // Rebias the exponent from 127 to 15
+    uint32_t rest = abs_x & 0x1fff;
+    h += rest > 0x1000 || (rest == 0x1000 && (h & 1));
+    return sign | h;
+}
+
+// Function definition for converting one half to float
+float half_to_float(uint16_t value) {
+    uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+    int exponent = (value >> 10) & 0x1f;
+    uint32_t mantissa = value & 0x3ff;
+    uint32_t x;
+
+    if (exponent == 0x1f) {
+        x = sign | 0x7f800000 | (mantissa << 13); // NaN or infinity
+    } else if (exponent == 0 && mantissa == 0) {
+        x = sign;
+    } else {
+        if (exponent == 0) {
+            exponent = 1; // Normalize a subnormal half
+            while ((mantissa & 0x400) == 0) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            mantissa &= 0x3ff;
+        }
+        x = sign | ((uint32_t)(exponent + 112) << 23) | (mantissa << 13);
+    }
+    float result;
+    memcpy(&result, &x, sizeof(result));
+    return result;
+}
+
+// Function definition for converting one float to bfloat16, rounding to nearest even and keeping NaNs quiet
+uint16_t float_to_bf16(float value) {
+    uint32_t x;
+    memcpy(&x, &value, sizeof(x));
+    x = (x & 0x7fffffff) > 0x7f800000 ? (x | 0x00400000) : x + 0x7fff + ((x >> 16) & 1);
+    return (uint16_t)(x >> 16);
+}
+
+// Function definition for converting one bfloat16 to float
+float bf16_to_float(uint16_t value) {
+    uint32_t x = (uint32_t)value << 16;
+    float result;
+    memcpy(&result, &x, sizeof(result));
+    return result;
+}
+
+// Function definition for converting floats to halves on the host, 8 at a time with F16C when available
+void float_to_half_host(const float *in, uint16_t *out, int size) {
+    int i = 0;
+#if defined(__F16C__)
+    for (; i + 8 <= size; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(&in[i]), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *)&out[i], h);
+    }
+#endif
+    for (; i < size; i++) {
+        out[i] = float_to_half(in[i]);
+    }
+}
+
+// Function definition for converting halves to floats on the host, 8 at a time with F16C when available
+void half_to_float_host(const uint16_t *in, float *out, int size) {
+    int i = 0;
+#if defined(__F16C__)
+    for (; i + 8 <= size; i += 8) {
+        _mm256_storeu_ps(&out[i], _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&in[i])));
+    }
+#endif
+    for (; i < size; i++) {
+        out[i] = half_to_float(in[i]);
+    }
+}
+
+// Function definition for converting floats to bfloat16 on the host, rounding to nearest even, 8 at a time with SSE2
+void float_to_bf16_host(const float *in, uint16_t *out, int size) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i abs_mask = _mm_set1_epi32(0x7fffffff), inf = _mm_set1_epi32(0x7f800000);
+    const __m128i bias = _mm_set1_epi32(0x7fff), one = _mm_set1_epi32(1), quiet = _mm_set1_epi32(0x00400000);
+    for (; i + 8 <= size; i += 8) {
+        __m128i halves[2];
+        for (int j = 0; j < 2; j++) {
+            __m128i x = _mm_loadu_si128((const __m128i *)&in[i + 4 * j]);
+            __m128i nan = _mm_cmpgt_epi32(_mm_and_si128(x, abs_mask), inf);
+            __m128i rounded = _mm_add_epi32(_mm_add_epi32(x, bias), _mm_and_si128(_mm_srli_epi32(x, 16), one));
+            __m128i bits = _mm_or_si128(_mm_and_si128(nan, _mm_or_si128(x, quiet)), _mm_andnot_si128(nan, rounded));
+            // Sign-extend the top 16 bits so the saturating pack keeps them unchanged
+            halves[j] = _mm_srai_epi32(bits, 16);
+        }
+        _mm_storeu_si128((__m128i *)&out[i], _mm_packs_epi32(halves[0], halves[1]));
+    }
+#endif
+    for (; i < size; i++) {
+        out[i] = float_to_bf16(in[i]);
+    }
+}
+
+// Function definition for converting bfloat16 to floats on the host, 8 at a time with SSE2
+void bf16_to_float_host(const uint16_t *in, float *out, int size) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= size; i += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i *)&in[i]);
+        _mm_storeu_si128((__m128i *)&out[i], _mm_unpacklo_epi16(zero, h)); // bf16 becomes the upper half of each float
+        _mm_storeu_si128((__m128i *)&out[i + 4], _mm_unpackhi_epi16(zero, h));
+    }
+#endif
+    for (; i < size; i++) {
+        out[i] = bf16_to_float(in[i]);
+    }
+}
+
+// Function definition for checking the vectorized host conversions bit for bit against the scalar helpers their
+// tail loops use. Every half and bf16 pattern is widened; floats with every sign, exponent and top
+// mantissa bits are narrowed, each with a zero, a bf16 halfway, a half halfway and a mixed low half. NaNs only have
+// to stay NaNs, F16C keeps payloads the scalar code drops.
+long conversion_mismatches() {
+    const int count = 4 * 65536;
+    uint32_t *bits = (uint32_t *)tracked_malloc(sizeof(uint32_t) * count);
+    float *wide = (float *)tracked_malloc(sizeof(float) * count);
+    uint16_t *narrow = (uint16_t *)tracked_malloc(sizeof(uint16_t) * count);
+    uint16_t *patterns = (uint16_t *)tracked_malloc(sizeof(uint16_t) * 65536);
+    const uint32_t low[4] = {0x0000, 0x8000, 0x1000, 0x5a5b};
+    for (int i = 0; i < count; i++) {
+        bits[i] = (uint32_t)(i / 4) << 16 | low[i % 4];
+    }
+    for (int i = 0; i < 65536; i++) {
+        patterns[i] = (uint16_t)i;
+    }
+    const float *in = (const float *)bits;
+    auto half_nan = [](uint16_t h) { return (h & 0x7c00) == 0x7c00 && (h & 0x3ff) != 0; };
+    long mismatches = 0;
+
+    float_to_half_host(in, narrow, count);
+    for (int i = 0; i < count; i++) {
+        uint16_t scalar = float_to_half(in[i]);
+        mismatches += narrow[i] != scalar && !(half_nan(narrow[i]) && half_nan(scalar));
+    }
+    float_to_bf16_host(in, narrow, count);
+    for (int i = 0; i < count; i++) {
+        mismatches += narrow[i] != float_to_bf16(in[i]);
+    }
+    half_to_float_host(patterns, wide, 65536);
+    for (int i = 0; i < 65536; i++) {
+        float scalar = half_to_float(patterns[i]);
+        mismatches += memcmp(&wide[i], &scalar, sizeof(float)) != 0 && !(isnan(wide[i]) && isnan(scalar));
+    }
+    bf16_to_float_host(patterns, wide, 65536);
+    for (int i = 0; i < 65536; i++) {
+        float scalar = bf16_to_float(patterns[i]);
+        mismatches += memcmp(&wide[i], &scalar, sizeof(float)) != 0;
+    }
+
+    tracked_free(bits);
+    tracked_free(wide);
+    tracked_free(narrow);
+    tracked_free(patterns);
+    return mismatches;
+}
+
+// Function definition for quantizing each row of a float matrix to int8 in [-127, 127] with a per-row scale.
+// q rows have stride ld >= cols, and the padding is zeroed.
+void quantize_rows_host(const float *x, int rows, int cols, int ld, int8_t *q, float *scales) {
+    for (int r = 0; r < rows; r++) {
+        float max_abs = 0;
+        for (int c = 0; c < cols; c++) {
+            max_abs = fabsf(x[(long)r * cols + c]) > max_abs ? fabsf(x[(long)r * cols + c]) : max_abs;
+        }
+        scales[r] = max_abs > 0 ? max_abs / 127.0f : 1.0f;
+        for (int c = 0; c < ld; c++) {
+            q[(long)r * ld + c] = c < cols ? (int8_t)lrintf(x[(long)r * cols + c] / scales[r]) : 0;
+        }
+    }
+}
+
+// Function definition for an int8 dot product on the host, inputs must lie in [-127, 127]
+int dot_int8_host(const int8_t *a, const int8_t *b, int k) {
+    int i = 0, sum = 0;
+#if defined(__AVX2__)
+    // Signed x signed via |a| (unsigned) times sign(a) * b (signed), the form the u8 x s8 instructions take
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 32 <= k; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)&a[i]);
+        __m256i y = _mm256_loadu_si256((const __m256i *)&b[i]);
+        __m256i abs_x = _mm256_sign_epi8(x, x);
+        __m256i signed_y = _mm256_sign_epi8(y, x);
+#if defined(__AVXVNNI__)
+        acc = _mm256_dpbusd_avx_epi32(acc, abs_x, signed_y);
+#elif defined(__AVX512VNNI__) && defined(__AVX512VL__)
+        acc = _mm256_dpbusd_epi32(acc, abs_x, signed_y);
+#else
+        __m256i pairs = _mm256_maddubs_epi16(abs_x, signed_y); // At most 2 * 127 * 127, no saturation
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, _mm256_set1_epi16(1)));
+#endif
+    }
+    __m128i sum4 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, 0x4e));
+    sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, 0xb1));
+    sum = _mm_cvtsi128_si32(sum4);
+#endif
+    for (; i < k; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// Arguments shared by the gemm_int8_host() workers
+struct gemm_int8_args {
+    const int8_t *a, *b;
+    int N, K;
+    const float *scale_a, *scale_b;
+    float *out;
+};
+
+// Function definition for int8 matrix multiply with int32 accumulation on the host, same layout as gemm_int8_ocl
+void gemm_int8_host(const int8_t *a, const int8_t *b, int M, int N, int K, const float *scale_a, const float *scale_b, float *out) {
+    gemm_int8_args args = {a, b, N, K, scale_a, scale_b, out};
+    parallel_for(M, [](int begin, int end, void *arg) {
+        gemm_int8_args *g = (gemm_int8_args *)arg;
+        // A block of B rows stays in cache while every row of this thread's A uses it
+        for (int n0 = 0; n0 < g->N; n0 += GEMM_BLOCK_N) {
+            int n1 = n0 + GEMM_BLOCK_N < g->N ? n0 + GEMM_BLOCK_N : g->N;
+            for (int m = begin; m < end; m++) {
+                for (int n = n0; n < n1; n++) {
+                    int acc = dot_int8_host(g->a + (long)m * g->K, g->b + (long)n * g->K, g->K);
+                    g->out[(long)m * g->N + n] = (float)acc * g->scale_a[m] * g->scale_b[n];
+                }
+            }
+        }
+    }, &args);
+}
+
+// Function definition for int8 matrix multiply on the device: a is M x K, b is N x K, K a multiple of 4
+void gemm_int8_ocl(cl_mem a, cl_mem b, int M, int N, int K, cl_mem scale_a, cl_mem scale_b, cl_mem out) {
+    int k4 = K / 4;
+    cl_kernel k = get_kernel("gemm_int8_ocl");
+    set_kernel_arg(k, 0, sizeof(int), &M);
+    set_kernel_arg(k, 1, sizeof(int), &N);
+    set_kernel_arg(k, 2, sizeof(int), &k4);
+    set_kernel_arg(k, 3, sizeof(cl_mem), &a);
+    set_kernel_arg(k, 4, sizeof(cl_mem), &b);
+    set_kernel_arg(k, 5, sizeof(cl_mem), &scale_a);
+    set_kernel_arg(k, 6, sizeof(cl_mem), &scale_b);
+    set_kernel_arg(k, 7, sizeof(cl_mem), &out);
+    size_t global_size[2] = {round_up(N, GEMM_TILE), round_up(M, GEMM_TILE)};
+    size_t local_size[2] = {GEMM_TILE, GEMM_TILE};
+    check_error(clEnqueueNDRangeKernel(queue, k, 2, NULL, global_size, local_size, 0, NULL, NULL), "Couldn't enqueue the GEMM");
+    check_error(pool_batch ? clFlush(queue) : clFinish(queue), "Couldn't finish the GEMM"); // Batched ops are waited for together
+}
+
+// Function definition for y = A x on the device, ld is in elements
+void gemv_ocl(cl_mem a, cl_mem x, cl_mem y, int rows, int cols, int ld, bool column_major) {
+    cl_kernel k = get_kernel(column_major ? "gemv_cols_ocl" : "gemv_rows_ocl");
+    set_kernel_arg(k, 0, sizeof(int), &rows);
+    set_kernel_arg(k, 1, sizeof(int), &cols);
+    set_kernel_arg(k, 2, sizeof(int), &ld);
+    set_kernel_arg(k, 3, sizeof(cl_mem), &a);
+    set_kernel_arg(k, 4, sizeof(cl_mem), &x);
+    set_kernel_arg(k, 5, sizeof(cl_mem), &y);
+    if (column_major) {
+        set_kernel_arg(k, 6, sizeof(float) * OP_LOCAL_SIZE, NULL);
+        run_kernel(k, round_up(rows, OP_LOCAL_SIZE), OP_LOCAL_SIZE); // One work-item per row
+    } else {
+        set_kernel_arg(k, 6, sizeof(float) * OP_LOCAL_SIZE * GEMV_ROWS, NULL);
+        run_kernel(k, (size_t)(rows + GEMV_ROWS - 1) / GEMV_ROWS * OP_LOCAL_SIZE, OP_LOCAL_SIZE); // One work-group per GEMV_ROWS rows
+    }
+}
+
+// Function definition for y = A x on the host, accumulating in double as the reference
+void gemv_host(const float *a, const float *x, float *y, int rows, int cols, int ld, bool column_major) {
+    for (int r = 0; r < rows; r++) {
+        double acc = 0;
+        for (int c = 0; c < cols; c++) {
+            acc += (double)(column_major ? a[(long)c * ld + r] : a[(long)r * ld + c]) * x[c];
+        }
+        y[r] = (float)acc;
+    }
+}
+
+// Function definition for a += alpha * u v^T on the device, u has rows elements and v has cols
+void ger_ocl(cl_mem a, cl_mem u, cl_mem v, float alpha, int rows, int cols, int ld, bool column_major) {
+    if (column_major) {
+        int swap = rows; rows = cols; cols = swap; // The transpose gets the update v u^T
+        cl_mem swap_mem = u; u = v; v = swap_mem;
+    }
+    cl_kernel k = get_kernel("ger_ocl");
+    set_kernel_arg(k, 0, sizeof(int), &rows);
+    set_kernel_arg(k, 1, sizeof(int), &cols);
+    set_kernel_arg(k, 2, sizeof(int), &ld);
+    set_kernel_arg(k, 3, sizeof(float), &alpha);
+    set_kernel_arg(k, 4, sizeof(cl_mem), &u);
+    set_kernel_arg(k, 5, sizeof(cl_mem), &v);
+    set_kernel_arg(k, 6, sizeof(cl_mem), &a);
+    run_kernel_2d(k, cols, rows);
+}
+
+// Function definition for out = a + b + alpha * u v^T on the device in one pass over the matrices
+void matrix_add_ger_ocl(cl_mem a, cl_mem b, cl_mem out, cl_mem u, cl_mem v, float alpha, int rows, int cols, int ld, bool column_major) {
+    if (column_major) {
+        int swap = rows; rows = cols; cols = swap; // The transpose gets the update v u^T
+        cl_mem swap_mem = u; u = v; v = swap_mem;
+    }
+    cl_kernel k = get_kernel("matrix_add_ger_ocl");
+    set_kernel_arg(k, 0, sizeof(int), &rows);
+    set_kernel_arg(k, 1, sizeof(int), &cols);
+    set_kernel_arg(k, 2, sizeof(int), &ld);
+    set_kernel_arg(k, 3, sizeof(float), &alpha);
+    set_kernel_arg(k, 4, sizeof(cl_mem), &u);
+    set_kernel_arg(k, 5, sizeof(cl_mem), &v);
+    set_kernel_arg(k, 6, sizeof(cl_mem), &a);
+    set_kernel_arg(k, 7, sizeof(cl_mem), &b);
+    set_kernel_arg(k, 8, sizeof(cl_mem), &out);
+    run_kernel_2d(k, cols, rows);
+}
+
+// Function definition for reducing a matrix along one axis on the device: one result per row if per_row, else per
+// column. If b is not NULL the reduction is over a + b, and the sum is never written to global memory.
+void reduce_axis_ocl(cl_mem a, cl_mem b, cl_mem out, int rows, int cols, int ld, bool column_major, bool per_row, reduce_op op) {
+    static const char *names[2][2][2] = {{{"sum_cols", "sum_rows"}, {"add_sum_cols", "add_sum_rows"}},
+                                         {{"max_cols", "max_rows"}, {"add_max_cols", "add_max_rows"}}};
+    if (column_major) {
+        int swap = rows; rows = cols; cols = swap; // A row of a column-major matrix is a column of its transpose
+        per_row = !per_row;
+    }
+    cl_kernel k = get_kernel(names[op][b != NULL][per_row]);
+    b = b != NULL ? b : a;
+    set_kernel_arg(k, 0, sizeof(int), &rows);
+    set_kernel_arg(k, 1, sizeof(int), &cols);
+    set_kernel_arg(k, 2, sizeof(int), &ld);
+    set_kernel_arg(k, 3, sizeof(cl_mem), &a);
+    set_kernel_arg(k, 4, sizeof(cl_mem), &b);
+    set_kernel_arg(k, 5, sizeof(cl_mem), &out);
+    if (per_row) {
+        set_kernel_arg(k, 6, sizeof(float) * OP_LOCAL_SIZE, NULL);
+        run_kernel(k, (size_t)rows * OP_LOCAL_SIZE, OP_LOCAL_SIZE); // One work-group per row
+    } else {
+        run_kernel(k, round_up(cols, OP_LOCAL_SIZE), OP_LOCAL_SIZE); // One work-item per column
+    }
+}
+
+// Function definition for reducing a matrix along one axis on the host, summing in double as the reference
+void reduce_axis_host(const float *a, const float *b, float *out, int rows, int cols, int ld, bool column_major, bool per_row, reduce_op op) {
+    int lines = per_row ? rows : cols;
+    int length = per_row ? cols : rows;
+    for (int line = 0; line < lines; line++) {
+        double acc = op == REDUCE_SUM ? 0.0 : -INFINITY;
+        for (int j = 0; j < length; j++) {
+            int r = per_row ? line : j;
+            int c = per_row ? j : line;
+            long i = column_major ? (long)c * ld + r : (long)r * ld + c;
+            double value = b != NULL ? (double)(a[i] + b[i]) : a[i]; // Round the sum to float as the device does
+            acc = op == REDUCE_SUM ? acc + value : (value > acc ? value : acc);
+        }
+        out[line] = (float)acc;
+    }
+}
+
+// Function definition for choosing the stencil vector width: the device's preferred float vector width
+int stencil_width() {
+    cl_uint width = 1;
+    clGetDeviceInfo(device_id, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, sizeof(width), &width, NULL);
+    return width == 2 || width == 4 || width == 8 || width == 16 ? (int)width : 1;
+}
+
+// Function definition for getting a stencil kernel with its radius, coefficients and vector width compiled in
+cl_kernel stencil_kernel(int radius, const float *coeffs, int width) {
+    int taps = 2 * radius + 1;
+    for (int i = 0; i < num_stencils; i++) {
+        if (stencil_cache[i].radius == radius && stencil_cache[i].width == width &&
+            memcmp(stencil_cache[i].coeffs, coeffs, sizeof(float) * taps) == 0) {
+            return stencil_cache[i].kernel;
+        }
+    }
+
+    // Coefficients are passed as exact float literals, so the compiler can fold them into the unrolled taps
+    char *options = (char *)tracked_malloc(128 + 20 * taps);
+    int length = sprintf(options, "-D STENCIL_RADIUS=%d -D STENCIL_WIDTH=%d -D STENCIL_LOCAL_SIZE=%d -D STENCIL_COEFFS=",
+                         radius, width, OP_LOCAL_SIZE);
+    for (int j = 0; j < taps; j++) {
+        length += sprintf(options + length, j ? ",%.9ef" : "%.9ef", coeffs[j]);
+    }
+    cl_program prog = build_program(context, device_id, STENCIL_FILE, options);
+    tracked_free(options);
+    cl_int err;
+    cl_kernel k = clCreateKernel(prog, "stencil_ocl", &err);
+    check_error(err, "Couldn't create the stencil kernel");
+
+    int slot;
+    if (num_stencils < STENCIL_CACHE) {
+        slot = num_stencils++;
+    } else {
+        slot = next_stencil; // Replace the oldest entry
+        next_stencil = (next_stencil + 1) % STENCIL_CACHE;
+        forget_kernel_args(stencil_cache[slot].kernel);
+        clReleaseKernel(stencil_cache[slot].kernel);
+        clReleaseProgram(stencil_cache[slot].program);
+    }
+    stencil_cache[slot].radius = radius;
+    stencil_cache[slot].width = width;
+    memcpy(stencil_cache[slot].coeffs, coeffs, sizeof(float) * taps);
+    stencil_cache[slot].program = prog;
+    stencil_cache[slot].kernel = k;
+    return k;
+}
+
+// Function definition for applying a 1D stencil on the device: out[i] = sum_j coeffs[j] * in[i + j - radius],
+// with zeros outside the signal. A width of 0 picks stencil_width().
+void stencil_ocl(cl_mem in, cl_mem out, int size, int radius, const float *coeffs, int width) {
+    if (radius < 0 || radius > STENCIL_MAX_RADIUS) {
+        printf("Stencil radius must be between 0 and %d\n", STENCIL_MAX_RADIUS);
+        exit(1);
+    }
+    width = width > 0 ? width : stencil_width();
+    cl_kernel k = stencil_kernel(radius, coeffs, width);
+    set_kernel_arg(k, 0, sizeof(int), &size);
+    set_kernel_arg(k, 1, sizeof(cl_mem), &in);
+    set_kernel_arg(k, 2, sizeof(cl_mem), &out);
+    run_kernel(k, round_up((size + width - 1) / width, OP_LOCAL_SIZE), OP_LOCAL_SIZE);
+}
+
+// Function definition for applying a 1D stencil on the host to the outputs in [begin, end), summing in double
+void stencil_host(const float *in, float *out, int size, int begin, int end, int radius, const float *coeffs) {
+    for (int i = begin; i < end; i++) {
+        double acc = 0;
+        for (int j = -radius; j <= radius; j++) {
+            if (i + j >= 0 && i + j < size) {
+                acc += (double)coeffs[j + radius] * in[i + j];
+            }
+        }
+        out[i] = (float)acc;
+    }
+}
+
+// Function definition for timing the fastest of BENCH_REPS runs of body, after one warm-up run
+template <typename Body> double best_time_ms(Body body) {
+    body();
+    double best = 0;
+    for (int rep = 0; rep < BENCH_REPS; rep++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        body();
+        std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - start;
+        best = rep == 0 || t.count() < best ? t.count() : best;
+    }
+    return best;
+}
+
+// Function definition for exp on the host: Cody-Waite range reduction and a degree 5 polynomial, about 2 ulp
+float exp_poly(float x) {
+    x = x < -104.0f ? -104.0f : (x > 89.0f ? 89.0f : x); // Beyond these the result is 0 or infinity anyway
+    float n = nearbyintf(x * 1.44269504088896341f);
+    float r = x - n * 0.693359375f - n * -2.12194440e-4f; // ln 2 split so n * ln 2 is exact
+    float y = 1.9875691500e-4f;
+    y = y * r + 1.3981999507e-3f;
+    y = y * r + 8.3334519073e-3f;
+    y = y * r + 4.1665795894e-2f;
+    y = y * r + 1.6666665459e-1f;
+    y = y * r + 5.0000001201e-1f;
+    y = y * r * r + r + 1.0f;
+    // Scale by 2^n in two steps, so n = 128 and results below FLT_MIN still work
+    int n1 = (int)n / 2, n2 = (int)n - n1;
+    uint32_t bits1 = (uint32_t)(n1 + 127) << 23, bits2 = (uint32_t)(n2 + 127) << 23;
+    float scale1, scale2;
+    memcpy(&scale1, &bits1, sizeof(float));
+    memcpy(&scale2, &bits2, sizeof(float));
+    return y * scale1 * scale2;
+}
+
+// Function definition for log on the host: mantissa in [sqrt(0.5), sqrt(2)) and a degree 9 polynomial, about 2 ulp.
+// Subnormal inputs are treated as zero.
+float log_poly(float x) {
+    if (!(x >= FLT_MIN) || x == INFINITY) {
+        return x == INFINITY ? x : (x >= 0.0f ? -INFINITY : NAN);
+    }
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(float));
+    float e = (float)((int)(bits >> 23) - 126);
+    bits = (bits & 0x007fffff) | 0x3f000000; // Mantissa in [0.5, 1)
+    float m;
+    memcpy(&m, &bits, sizeof(float));
+    if (m < 0.707106781186547524f) {
+        e -= 1.0f;
+        m = m + m - 1.0f;
+    } else {
+        m = m - 1.0f;
+    }
+    float z = m * m;
+    float y = 7.0376836292e-2f;
+    y = y * m - 1.1514610310e-1f;
+    y = y * m + 1.1676998740e-1f;
+    y = y * m - 1.2420140846e-1f;
+    y = y * m + 1.4249322787e-1f;
+    y = y * m - 1.6668057665e-1f;
+    y = y * m + 2.0000714765e-1f;
+    y = y * m - 2.4999993993e-1f;
+    y = y * m + 3.3333331174e-1f;
+    y = y * m * z + e * -2.12194440e-4f - 0.5f * z;
+    return m + y + e * 0.693359375f;
+}
+
+#if defined(__AVX2__)
+// Function definition for exp_poly() on 8 floats at once
+__m256 exp_poly8(__m256 x) {
+    __m256 nan_mask = _mm256_cmp_ps(x, x, _CMP_UNORD_Q);
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-104.0f)), _mm256_set1_ps(89.0f));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(0.693359375f)));
+    r = _mm256_sub_ps(r, _mm256_mul_ps(n, _mm256_set1_ps(-2.12194440e-4f)));
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(1.3981999507e-3f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(8.3334519073e-3f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(4.1665795894e-2f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(1.6666665459e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(5.0000001201e-1f));
+    y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(y, r), r), r), _mm256_set1_ps(1.0f));
+    __m256i ni = _mm256_cvtps_epi32(n);
+    __m256i n1 = _mm256_srai_epi32(_mm256_add_epi32(ni, _mm256_srli_epi32(ni, 31)), 1); // n / 2 rounded toward zero
+    __m256i n2 = _mm256_sub_epi32(ni, n1);
+    __m256 scale1 = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(n1, _mm256_set1_epi32(127)), 23));
+    __m256 scale2 = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(n2, _mm256_set1_epi32(127)), 23));
+    return _mm256_or_ps(_mm256_mul_ps(_mm256_mul_ps(y, scale1), scale2), nan_mask); // NaN stays NaN
+}
+
+// Function definition for log_poly() on 8 floats at once
+__m256 log_poly8(__m256 x) {
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256i bits = _mm256_castps_si256(x);
+    __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126)));
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f000000)));
+    __m256 small = _mm256_cmp_ps(m, _mm256_set1_ps(0.707106781186547524f), _CMP_LT_OQ);
+    e = _mm256_sub_ps(e, _mm256_and_ps(small, one));
+    m = _mm256_add_ps(_mm256_sub_ps(m, one), _mm256_and_ps(small, m));
+    __m256 z = _mm256_mul_ps(m, m);
+    __m256 y = _mm256_set1_ps(7.0376836292e-2f);
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.1514610310e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.1676998740e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.2420140846e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.4249322787e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.6668057665e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(2.0000714765e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-2.4999993993e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(3.3333331174e-1f));
+    y = _mm256_mul_ps(_mm256_mul_ps(y, m), z);
+    y = _mm256_add_ps(y, _mm256_mul_ps(e, _mm256_set1_ps(-2.12194440e-4f)));
+    y = _mm256_sub_ps(y, _mm256_mul_ps(z, _mm256_set1_ps(0.5f)));
+    __m256 result = _mm256_add_ps(_mm256_add_ps(m, y), _mm256_mul_ps(e, _mm256_set1_ps(0.693359375f)));
+
+    // Zero and subnormals give -infinity, negatives and NaN give NaN, infinity gives infinity
+    result = _mm256_blendv_ps(result, _mm256_set1_ps(-INFINITY), _mm256_cmp_ps(x, _mm256_set1_ps(FLT_MIN), _CMP_LT_OQ));
+    result = _mm256_blendv_ps(result, _mm256_set1_ps(NAN), _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_NGE_UQ));
+    return _mm256_blendv_ps(result, x, _mm256_cmp_ps(x, _mm256_set1_ps(INFINITY), _CMP_EQ_OQ));
+}
+#endif
+
+// Function definition for applying a math function with the host polynomials on the calling thread
+void math_host_block(math_func f, const float *in, float *out, int size) {
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256 one = _mm256_set1_ps(1.0f);
+    for (; i + 8 <= size; i += 8) {
+        __m256 x = _mm256_loadu_ps(&in[i]);
+        __m256 y;
+        switch (f) {
+        case MATH_EXP: y = exp_poly8(x); break;
+        case MATH_LOG: y = log_poly8(x); break;
+        case MATH_SQRT: y = _mm256_sqrt_ps(x); break; // Correctly rounded and already fast
+        default: y = _mm256_div_ps(one, _mm256_add_ps(one, exp_poly8(_mm256_sub_ps(_mm256_setzero_ps(), x)))); break;
+        }
+        _mm256_storeu_ps(&out[i], y);
+    }
+#endif
+    for (; i < size; i++) {
+        switch (f) {
+        case MATH_EXP: out[i] = exp_poly(in[i]); break;
+        case MATH_LOG: out[i] = log_poly(in[i]); break;
+        case MATH_SQRT: out[i] = sqrtf(in[i]); break;
+        default: out[i] = 1.0f / (1.0f + exp_poly(-in[i])); break;
+        }
+    }
+}
+
+// Arguments shared by the math_host() workers
+struct math_args {
+    math_func f;
+    const float *in;
+    float *out;
+};
+
+// Function definition for applying a math function with the host polynomials on all host threads
+void math_host(math_func f, const float *in, float *out, int size) {
+    math_args args = {f, in, out};
+    parallel_for(size, [](int begin, int end, void *arg) {
+        math_args *m = (math_args *)arg;
+        math_host_block(m->f, m->in + begin, m->out + begin, end - begin);
+    }, &args);
+}
+
+// Function definition for applying a math function on the device with one of the built-in tiers
+void math_ocl(math_func f, math_tier tier, cl_mem in, cl_mem out, int size) {
+    static const char *names[MATH_FUNCS][MATH_HOST] = {{"exp_full", "exp_native", "exp_half"},
+                                                       {"log_full", "log_native", "log_half"},
+                                                       {"sqrt_full", "sqrt_native", "sqrt_half"},
+                                                       {"sigmoid_full", "sigmoid_native", "sigmoid_half"}};
+    if (tier == MATH_HOST) {
+        printf("The host math tier has no device kernel\n");
+        exit(1);
+    }
+    cl_kernel k = get_kernel(names[f][tier]);
+    set_kernel_arg(k, 0, sizeof(int), &size);
+    set_kernel_arg(k, 1, sizeof(cl_mem), &in);
+    set_kernel_arg(k, 2, sizeof(cl_mem), &out);
+    run_kernel(k, round_up(size, OP_LOCAL_SIZE), OP_LOCAL_SIZE);
+}
+
+// Function definition for spreading n inputs evenly over a math function's domain (log-spaced for log and sqrt)
+float math_input(math_func f, long i, long n) {
+    double t = (i + 0.5) / n;
+    switch (f) {
+    case MATH_EXP: return (float)(-80.0 + 160.0 * t);
+    case MATH_LOG:
+    case MATH_SQRT: return (float)pow(10.0, -30.0 + 60.0 * t);
+    default: return (float)(-30.0 + 60.0 * t);
+    }
+}
+
+// Function definition for the double precision result of a math function
+double math_reference(math_func f, double x) {
+    switch (f) {
+    case MATH_EXP: return exp(x);
+    case MATH_LOG: return log(x);
+    case MATH_SQRT: return sqrt(x);
+    default: return 1.0 / (1.0 + exp(-x));
+    }
+}
+
+// Function definition for the error of one math result: relative to the reference, or absolute below magnitude 1
+double math_error_of(float result, double reference) {
+    if (isinf(reference) && result == (float)reference) {
+        return 0;
+    }
+    double magnitude = fabs(reference) > 1.0 ? fabs(reference) : 1.0;
+    double error = fabs(result - reference) / magnitude;
+    return isnan(error) ? INFINITY : error;
+}
+
+// Function definition for measuring the error and speed of every math tier on MATH_PROBE inputs
+void calibrate_math() {
+    float *in = (float *)tracked_malloc(sizeof(float) * MATH_PROBE);
+    float *out = (float *)tracked_malloc(sizeof(float) * MATH_PROBE);
+    cl_mem bufIn = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(float) * MATH_PROBE, NULL, &err);
+    check_error(err, "Couldn't create the math probe input");
+    cl_mem bufOut = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(float) * MATH_PROBE, NULL, &err);
+    check_error(err, "Couldn't create the math probe output");
+
+    double transfer_t = best_time_ms([&] {
+        clEnqueueWriteBuffer(queue, bufIn, CL_TRUE, 0, sizeof(float) * MATH_PROBE, in, 0, NULL, NULL);
+        clEnqueueReadBuffer(queue, bufOut, CL_TRUE, 0, sizeof(float) * MATH_PROBE, out, 0, NULL, NULL);
+    });
+    math_transfer_ns = transfer_t * 1e6 / MATH_PROBE;
+
+    for (int f = 0; f < MATH_FUNCS; f++) {
+        for (long i = 0; i < MATH_PROBE; i++) {
+            in[i] = math_input((math_func)f, i, MATH_PROBE);
+        }
+        clEnqueueWriteBuffer(queue, bufIn, CL_TRUE, 0, sizeof(float) * MATH_PROBE, in, 0, NULL, NULL);
+        for (int tier = 0; tier < MATH_TIERS; tier++) {
+            double t;
+            if (tier == MATH_HOST) {
+                t = best_time_ms([&] { math_host((math_func)f, in, out, MATH_PROBE); });
+            } else {
+                t = best_time_ms([&] { math_ocl((math_func)f, (math_tier)tier, bufIn, bufOut, MATH_PROBE); });
+                clEnqueueReadBuffer(queue, bufOut, CL_TRUE, 0, sizeof(float) * MATH_PROBE, out, 0, NULL, NULL);
+            }
+            math_ns[f][tier] = t * 1e6 / MATH_PROBE;
+            double max_error = 0;
+            for (long i = 0; i < MATH_PROBE; i++) {
+                double error = math_error_of(out[i], math_reference((math_func)f, in[i]));
+                max_error = error > max_error ? error : max_error;
+            }
+            math_error[f][tier] = max_error;
+        }
+    }
+    math_calibrated = true;
+
+    tracked_clReleaseMemObject(bufIn);
+    tracked_clReleaseMemObject(bufOut);
+    tracked_free(in);
+    tracked_free(out);
+}
+
+// Function definition for choosing the fastest math tier whose error is within budget. With host_data the data
+// lives on the host, so device tiers pay for the transfers; otherwise only device tiers are considered. If no
+// tier meets the budget, the most accurate one is returned.
+math_tier select_math_tier(math_func f, double budget, bool host_data) {
+    if (!math_calibrated) {
+        calibrate_math();
+    }
+    int best = -1, most_accurate = MATH_FULL;
+    double best_cost = 0;
+    for (int tier = 0; tier < (host_data ? MATH_TIERS : MATH_HOST); tier++) {
+        if (math_error[f][tier] < math_error[f][most_accurate]) {
+            most_accurate = tier;
+        }
+        double cost = math_ns[f][tier] + (host_data && tier != MATH_HOST ? math_transfer_ns : 0);
+        if (math_error[f][tier] <= budget && (best < 0 || cost < best_cost)) {
+            best = tier;
+            best_cost = cost;
+        }
+    }
+    return (math_tier)(best >= 0 ? best : most_accurate);
+}
+
+// Function definition for applying a math function to host data with the fastest tier within budget
+math_tier apply_math(math_func f, const float *in, float *out, int size, double budget) {
+    math_tier tier = select_math_tier(f, budget, true);
+    if (tier == MATH_HOST) {
+        perf_begin(); // Start hardware counters for the host math
+        math_host(f, in, out, size);
+        perf_end("math_host"); // Print hardware counters for the host math
+        return tier;
+    }
+    cl_mem bufIn = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * size, (void *)in, &err);
+    check_error(err, "Couldn't create the math input");
+    cl_mem bufOut = create_buffer_spilling(CL_MEM_WRITE_ONLY, sizeof(float) * size, NULL, &err);
+    check_error(err, "Couldn't create the math output");
+    math_ocl(f, tier, bufIn, bufOut, size);
+    clEnqueueReadBuffer(queue, bufOut, CL_TRUE, 0, sizeof(float) * size, out, 0, NULL, NULL);
+    tracked_clReleaseMemObject(bufIn);
+    tracked_clReleaseMemObject(bufOut);
+    return tier;
+}
+
+// Function definition for running an extra vector op on the device buffers after the add
+void run_vector_op(const char *op) {
+    cl_int err;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // Route a transfer-bound op to the ranked device that moves its traffic fastest; vectors resident on the current
+    // device would have to be uploaded again elsewhere
+    size_t traffic = op_transfer_bytes(op);
+    if (DEVICE_RANKING && num_ranked_devices > 1 && traffic > 0) {
+        switch_device(select_device_for_op(traffic, device_id, resident_bytes()));
+    }
+
+    // The ops use v1, v2 and v_out on the device and may change any of them
+    begin_managed_op();
+    bufV1 = device_backend.device_mem(dev_v1, true, true);
+    bufV2 = device_backend.device_mem(dev_v2, true, true);
+    bufV_out = device_backend.device_mem(dev_v_out, true, true);
+    copy_kernel_args(); // The add kernel follows if any of them was evicted and created again
+
+    if (strcmp(op, "gather") == 0) {
+        // v_out[i] = v2[v1[i]], v1 holds indices 0..99
+        device_backend.gather(dev_v1, dev_v2, dev_v_out, SZ);
+        device_backend.download(v_out, dev_v_out, SZ);
+        std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - start;
+        long mismatches = 0;
+        for (long i = 0; i < SZ; i++) {
+            mismatches += v_out[i] != v2[v1[i]];
+        }
+        printf("gather: %f ms, %ld mismatches\n", t.count(), mismatches);
+    } else if (strcmp(op, "scatter") == 0 || strcmp(op, "scatter_add") == 0) {
+        // out[v1[i]] (+)= v2[i] over the 100 distinct values of v1
+        const int out_size = 100;
+        bool add = strcmp(op, "scatter_add") == 0;
+        long mismatches;
+        if (add) {
+            mismatches = scatter_add_mismatches(bufV1, v1, SZ, out_size);
+        } else {
+            int out[out_size];
+            int zero = 0;
+            cl_mem bufOut = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * out_size, NULL, &err);
+            check_error(err, "Couldn't create the scatter output");
+            clEnqueueFillBuffer(queue, bufOut, &zero, sizeof(int), 0, sizeof(int) * out_size, 0, NULL, NULL);
+            backend_buffer out_buf = {bufOut, NULL, sizeof(int) * out_size, -1};
+            device_backend.scatter(dev_v1, dev_v2, out_buf, SZ);
+            clEnqueueReadBuffer(queue, bufOut, CL_TRUE, 0, sizeof(int) * out_size, out, 0, NULL, NULL);
+            deferred_release(bufOut);
+            mismatches = scatter_mismatches(out, v1, v2, SZ, out_size);
+        }
+        std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - start;
+        printf("%s: %f ms, %ld mismatches\n", op, t.count(), mismatches);
+
+        if (add) {
+            // An output too large for local memory takes global atomics when indices rarely repeat, and the sort and
+            // segmented reduce when they repeat often
+            int *idx = (int *)tracked_malloc(sizeof(int) * SZ);
+            cl_mem bufIdx = create_buffer_spilling(CL_MEM_READ_ONLY, sizeof(int) * SZ, NULL, &err);
+            check_error(err, "Couldn't create the scatter indices");
+            const int spreads[2] = {LARGE_SCATTER_BINS, DENSE_SCATTER_BINS};
+            for (int s = 0; s < 2; s++) {
+                for (long i = 0; i < SZ; i++) {
+                    idx[i] = rand() % spreads[s];
+                }
+                check_error(clEnqueueWriteBuffer(queue, bufIdx, CL_TRUE, 0, sizeof(int) * SZ, idx, 0, NULL, NULL),
+                            "Couldn't write the scatter indices");
+                long large_mismatches = scatter_add_mismatches(bufIdx, idx, SZ, LARGE_SCATTER_BINS);
+                printf("%s over %d bins, indices below %d: %ld mismatches\n", op, LARGE_SCATTER_BINS, spreads[s],
+                       large_mismatches);
+            }
+            deferred_release(bufIdx);
+            tracked_free(idx);
+        }
+    } else if (strcmp(op, "hist") == 0) {
+        // v_out = v1 + v2 holds values 0..198
+        const int num_bins = 199;
+        int hist[num_bins], expected[num_bins];
+        cl_mem bufHist = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * num_bins, NULL, &err);
+        check_error(err, "Couldn't create the histogram");
+
+        histogram_ocl(bufV_out, SZ, bufHist, num_bins, 0);
+        clEnqueueReadBuffer(queue, bufHist, CL_TRUE, 0, sizeof(int) * num_bins, hist, 0, NULL, NULL);
+        std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - start;
+
+        auto host_start = std::chrono::high_resolution_clock::now();
+        perf_begin(); // Start hardware counters for the host histogram
+        histogram_host(v_out, SZ, expected, num_bins, 0);
+        std::chrono::duration<double, std::milli> host_t = std::chrono::high_resolution_clock::now() - host_start;
+        perf_end("histogram_host"); // Print hardware counters for the host histogram
+
+        long mismatches = 0;
+        for (int b = 0; b < num_bins; b++) {
+            mismatches += hist[b] != expected[b];
+        }
+        printf("hist: device %f ms, host (%d threads) %f ms, %ld mismatches\n", t.count(), host_threads(), host_t.count(), mismatches);
+        deferred_release(bufHist);
+    } else if (strcmp(op, "sort") == 0) {
+        // Sort v_out on the device, with v1 as the values, and compare with the host radix sort
+        int *sorted_keys = (int *)tracked_malloc(sizeof(int) * SZ);
+        int *sorted_values = (int *)tracked_malloc(sizeof(int) * SZ);
+        radix_sort_ocl(bufV_out, bufV1, SZ, false);
+        clEnqueueReadBuffer(queue, bufV_out, CL_TRUE, 0, SZ * sizeof(int), sorted_keys, 0, NULL, NULL);
+        clEnqueueReadBuffer(queue, bufV1, CL_TRUE, 0, SZ * sizeof(int), sorted_values, 0, NULL, NULL);
+        std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - start;
+
+        auto host_start = std::chrono::high_resolution_clock::now();
+        perf_begin(); // Start hardware counters for the host sort
+        radix_sort_host(v_out, v1, SZ);
+        std::chrono::duration<double, std::milli> host_t = std::chrono::high_resolution_clock::now() - host_start;
+        perf_end("radix_sort_host"); // Print hardware counters for the host sort
+
+        long mismatches = 0;
+        for (long i = 0; i < SZ; i++) {
+            mismatches += sorted_keys[i] != v_out[i] || sorted_values[i] != v1[i]; // Both sorts are stable
+        }
+        printf("sort: device %f ms, host (%d threads) %f ms, %ld mismatches\n", t.count(), host_threads(), host_t.count(), mismatches);
+        deferred_free(sorted_keys);
+        deferred_free(sorted_values);
+    } else if (strcmp(op, "topk") == 0) {
+        // Only the 10 largest values of v_out come back to the host
+        const int k = 10;
+        int top[k];
+        topk_ocl(bufV_out, SZ, k, top);
+        std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - start;
+
+        int *expected = (int *)tracked_malloc(sizeof(int) * SZ);
+        memcpy(expected, v_out, sizeof(int) * SZ);
+        radix_sort_host(expected, (int *)NULL, SZ);
+        long mismatches = 0;
+        for (int i = 0; i < k; i++) {
+            mismatches += top[i] != expected[SZ - 1 - i];
+        }
+        printf("topk: %f ms, %ld mismatches, largest %d\n", t.count(), mismatches, top[0]);
+        deferred_free(expected);
+    } else if (strcmp(op, "threshold") == 0) {
+        // Count and select the values of v_out above 190
+        const int threshold = 190;
+        int count = count_above_ocl(bufV_out, SZ, threshold);
+        std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - start;
+
+        cl_mem bufSelected = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * (count > 0 ? count : 1), NULL, &err);
+        check_error(err, "Couldn't create the selection");
+        int selected = select_above_ocl(bufV_out, SZ, threshold, bufSelected);
+        std::chrono::duration<double, std::milli> select_t = std::chrono::high_resolution_clock::now() - start;
+
+        // The selection order depends on the work-group schedule, so both sides are sorted before comparing
+        int *expected = (int *)tracked_malloc(sizeof(int) * SZ);
+        int num_expected = 0;
+        for (long i = 0; i < SZ; i++) {
+            if (v_out[i] > threshold) {
+                expected[num_expected++] = v_out[i];
+            }
+        }
+        int num_read = selected < count ? selected : count;
+        int *values = (int *)tracked_malloc(sizeof(int) * (num_read > 0 ? num_read : 1));
+        clEnqueueReadBuffer(queue, bufSelected, CL_TRUE, 0, sizeof(int) * num_read, values, 0, NULL, NULL);
+        radix_sort_host(values, (int *)NULL, num_read);
+        radix_sort_host(expected, (int *)NULL, num_expected);
+
+        long mismatches = (count != num_expected) + (selected != num_expected);
+        for (int i = 0; i < num_read && i < num_expected; i++) {
+            mismatches += values[i] != expected[i];
+        }
+        printf("threshold: count %d in %f ms, selected %d in %f ms, expected %d, %ld mismatches\n", count, t.count(), selected,
+               select_t.count() - t.count(), num_expected, mismatches);
+        deferred_free(expected);
+        deferred_free(values);
+        deferred_release(bufSelected);
+    } else if (strcmp(op, "packed_add") == 0) {
+        // Ship v1 and v2 bit-packed, add them while decoding, and pack the sums on the way back
+        int num_chunks = (SZ + CODEC_CHUNK - 1) / CODEC_CHUNK;
+        int *headers1 = (int *)tracked_malloc(sizeof(int) * 3 * num_chunks);
+        int *headers2 = (int *)tracked_malloc(sizeof(int) * 3 * num_chunks);
+        unsigned *words1, *words2;
+        perf_begin(); // Start hardware counters for packing the inputs
+        size_t num_words1 = pack_host(v1, SZ, headers1, &words1);
+        size_t num_words2 = pack_host(v2, SZ, headers2, &words2);
+        std::chrono::duration<double, std::milli> pack_t = std::chrono::high_resolution_clock::now() - start;
+        perf_end("pack_host"); // Print hardware counters for packing the inputs
+
+        size_t raw_bytes = 2 * sizeof(int) * (size_t)SZ;
+        size_t packed_bytes = sizeof(unsigned) * (num_words1 + num_words2) + 2 * sizeof(int) * 3 * num_chunks;
+        // The widest chunk sum sets the output width
+        int out_bits = 1;
+        int *out_bases = (int *)tracked_malloc(sizeof(int) * num_chunks);
+        for (int c = 0; c < num_chunks; c++) {
+            uint64_t range = (((uint64_t)1 << headers1[3 * c + 1]) - 1) + (((uint64_t)1 << headers2[3 * c + 1]) - 1);
+            int bits = range >> 32 ? 33 : bit_width((unsigned)range);
+            out_bits = bits > out_bits ? bits : out_bits;
+            out_bases[c] = headers1[3 * c] + headers2[3 * c];
+        }
+
+        if (packed_bytes > CODEC_MAX_RATIO * raw_bytes || out_bits > 32) {
+            printf("packed_add: inputs only pack to %.0f%% of raw size, not worth decoding\n", 100.0 * packed_bytes / raw_bytes);
+        } else {
+            int num_out_words = (int)(((size_t)SZ * out_bits + 31) / 32);
+
+            auto transfer_start = std::chrono::high_resolution_clock::now();
+            cl_mem bufH1 = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int) * 3 * num_chunks, headers1, &err);
+            check_error(err, "Couldn't create the packed headers of v1");
+            cl_mem bufH2 = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int) * 3 * num_chunks, headers2, &err);
+            check_error(err, "Couldn't create the packed headers of v2");
+            cl_mem bufW1 = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(unsigned) * (num_words1 + 1), words1, &err);
+            check_error(err, "Couldn't create the packed words of v1");
+            cl_mem bufW2 = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(unsigned) * (num_words2 + 1), words2, &err);
+            check_error(err, "Couldn't create the packed words of v2");
+            cl_mem bufPacked = create_buffer_spilling(CL_MEM_WRITE_ONLY, sizeof(unsigned) * num_out_words, NULL, &err);
+            check_error(err, "Couldn't create the packed output");
+
+            cl_kernel k = get_kernel("decode_add_pack_ocl");
+            set_kernel_arg(k, 0, sizeof(int), &SZ);
+            set_kernel_arg(k, 1, sizeof(cl_mem), &bufH1);
+            set_kernel_arg(k, 2, sizeof(cl_mem), &bufW1);
+            set_kernel_arg(k, 3, sizeof(cl_mem), &bufH2);
+            set_kernel_arg(k, 4, sizeof(cl_mem), &bufW2);
+            set_kernel_arg(k, 5, sizeof(int), &out_bits);
+            set_kernel_arg(k, 6, sizeof(cl_mem), &bufPacked);
+            set_kernel_arg(k, 7, sizeof(int), &num_out_words);
+            run_kernel(k, round_up(num_out_words, OP_LOCAL_SIZE), OP_LOCAL_SIZE);
+
+            unsigned *packed_out = (unsigned *)tracked_malloc(sizeof(unsigned) * (num_out_words + 1));
+            packed_out[num_out_words] = 0;
+            clEnqueueReadBuffer(queue, bufPacked, CL_TRUE, 0, sizeof(unsigned) * num_out_words, packed_out, 0, NULL, NULL);
+            std::chrono::duration<double, std::milli> transfer_t = std::chrono::high_resolution_clock::now() - transfer_start;
+
+            auto unpack_start = std::chrono::high_resolution_clock::now();
+            perf_begin(); // Start hardware counters for unpacking the sums
+            unpack_host(packed_out, SZ, out_bits, out_bases, v_out);
+            std::chrono::duration<double, std::milli> unpack_t = std::chrono::high_resolution_clock::now() - unpack_start;
+            perf_end("unpack_host"); // Print hardware counters for unpacking the sums
+
+            long mismatches = 0;
+            for (long i = 0; i < SZ; i++) {
+                mismatches += v_out[i] != v1[i] + v2[i];
+            }
+            printf("packed_add: %.1f MB sent instead of %.1f MB, %.1f MB back at %d bits, pack %f ms, device %f ms, unpack %f ms, %ld mismatches\n",
+                   packed_bytes / 1048576.0, raw_bytes / 1048576.0, num_out_words * 4 / 1048576.0, out_bits,
+                   pack_t.count(), transfer_t.count(), unpack_t.count(), mismatches);
+
+            deferred_release(bufH1);
+            deferred_release(bufH2);
+            deferred_release(bufW1);
+            deferred_release(bufW2);
+            deferred_release(bufPacked);
+            deferred_free(packed_out);
+        }
+        deferred_free(out_bases);
+        deferred_free(headers1);
+        deferred_free(headers2);
+        deferred_free(words1);
+        deferred_free(words2);
+    } else if (strcmp(op, "float_add") == 0) {
+        // Float vector and matrix adds with f32, f16 and bf16 storage, compared against an fp32 host add. The host
+        // conversions feeding them are checked first.
+        printf("float_add: host conversions (%s) against the scalar code, %ld mismatches\n",
+#if defined(__F16C__)
+               "F16C and SSE2",
+#elif defined(__SSE2__)
+               "SSE2 bf16",
+#else
+               "scalar only",
+#endif
+               conversion_mismatches());
+        float *a = (float *)tracked_malloc(sizeof(float) * SZ);
+        float *b = (float *)tracked_malloc(sizeof(float) * SZ);
+        float *result = (float *)tracked_malloc(sizeof(float) * SZ);
+        uint16_t *staging = (uint16_t *)tracked_malloc(sizeof(uint16_t) * SZ);
+        for (long i = 0; i < SZ; i++) {
+            a[i] = v1[i] * 0.37f + 0.5f;
+            b[i] = v2[i] * 1.13f - 20.0f;
+        }
+        int rows, cols;
+        matrix_shape(SZ, &rows, &cols);
+
+        for (int type = STORAGE_F32; type <= STORAGE_BF16; type++) {
+            size_t bytes = storage_size((storage_type)type) * SZ;
+            cl_mem bufA = create_buffer_spilling(CL_MEM_READ_ONLY, bytes, NULL, &err);
+            check_error(err, "Couldn't create the float input a");
+            cl_mem bufB = create_buffer_spilling(CL_MEM_READ_ONLY, bytes, NULL, &err);
+            check_error(err, "Couldn't create the float input b");
+            cl_mem bufC = create_buffer_spilling(CL_MEM_READ_WRITE, bytes, NULL, &err);
+            check_error(err, "Couldn't create the float output");
+
+            // Vector, row-major matrix, and column-major matrix whose last row is padding, so a leading dimension
+            // or transpose mix-up shows as a mismatch
+            const char *layout_names[3] = {"vector", "matrix", "column-major matrix"};
+            for (int layout = 0; layout < 3; layout++) {
+                int m_rows = layout == 2 && rows > 1 ? rows - 1 : rows;
+                int ld = layout == 2 ? rows : cols;
+                auto op_start = std::chrono::high_resolution_clock::now();
+                const float *inputs[2] = {a, b};
+                cl_mem bufs[2] = {bufA, bufB};
+                for (int j = 0; j < 2; j++) {
+                    const void *src = inputs[j];
+                    if (type == STORAGE_F16) {
+                        float_to_half_host(inputs[j], staging, SZ);
+                        src = staging;
+                    } else if (type == STORAGE_BF16) {
+                        float_to_bf16_host(inputs[j], staging, SZ);
+                        src = staging;
+                    }
+                    clEnqueueWriteBuffer(queue, bufs[j], CL_TRUE, 0, bytes, src, 0, NULL, NULL);
+                }
+                if (layout) {
+                    matrix_add_float_ocl(bufA, bufB, bufC, m_rows, cols, ld, layout == 2, (storage_type)type);
+                } else {
+                    vector_add_float_ocl(bufA, bufB, bufC, SZ, (storage_type)type);
+                }
+                clEnqueueReadBuffer(queue, bufC, CL_TRUE, 0, bytes, type == STORAGE_F32 ? (void *)result : (void *)staging, 0, NULL, NULL);
+                if (type == STORAGE_F16) {
+                    half_to_float_host(staging, result, SZ);
+                } else if (type == STORAGE_BF16) {
+                    bf16_to_float_host(staging, result, SZ);
+                }
+                std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - op_start;
+
+                long count = layout ? (long)rows * cols : SZ;
+                double max_abs = 0, max_rel = 0;
+                for (long i = 0; i < count; i++) {
+                    if (layout == 2 && i % ld >= m_rows) {
+                        continue; // Padding below each column is not written
+                    }
+                    double expected = (double)a[i] + b[i];
+                    double diff = fabs(result[i] - expected);
+                    max_abs = diff > max_abs ? diff : max_abs;
+                    if (fabs(expected) > 1e-3 && diff / fabs(expected) > max_rel) {
+                        max_rel = diff / fabs(expected);
+                    }
+                }
+                printf("float_add %s %s: %f ms including conversion and transfer, max abs error %g, max rel error %g\n",
+                       layout_names[layout], storage_names[type], t.count(), max_abs, max_rel);
+            }
+            deferred_release(bufA);
+            deferred_release(bufB);
+            deferred_release(bufC);
+        }
+        deferred_free(a);
+        deferred_free(b);
+        deferred_free(result);
+        deferred_free(staging);
+    } else if (strcmp(op, "gemm_int8") == 0) {
+        // Quantize two random GEMM_DIM square matrices and multiply them on the device and on the host
+        const int M = GEMM_DIM, N = GEMM_DIM, K = GEMM_DIM;
+        const int ld = (K + 3) / 4 * 4; // Rows padded to whole packed words
+        float *fa = (float *)tracked_malloc(sizeof(float) * M * K);
+        float *fb = (float *)tracked_malloc(sizeof(float) * N * K); // Stored transposed, N x K
+        int8_t *qa = (int8_t *)tracked_malloc((size_t)M * ld);
+        int8_t *qb = (int8_t *)tracked_malloc((size_t)N * ld);
+        float *scale_a = (float *)tracked_malloc(sizeof(float) * M);
+        float *scale_b = (float *)tracked_malloc(sizeof(float) * N);
+        float *device_out = (float *)tracked_malloc(sizeof(float) * M * N);
+        float *host_out = (float *)tracked_malloc(sizeof(float) * M * N);
+        for (long i = 0; i < (long)M * K; i++) {
+            fa[i] = (rand() % 2001 - 1000) / 100.0f;
+        }
+        for (long i = 0; i < (long)N * K; i++) {
+            fb[i] = (rand() % 2001 - 1000) / 250.0f;
+        }
+        quantize_rows_host(fa, M, K, ld, qa, scale_a);
+        quantize_rows_host(fb, N, K, ld, qb, scale_b);
+
+        cl_mem bufA = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, (size_t)M * ld, qa, &err);
+        check_error(err, "Couldn't create the GEMM matrix a");
+        cl_mem bufB = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, (size_t)N * ld, qb, &err);
+        check_error(err, "Couldn't create the GEMM matrix b");
+        cl_mem bufSA = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * M, scale_a, &err);
+        check_error(err, "Couldn't create the GEMM row scales");
+        cl_mem bufSB = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * N, scale_b, &err);
+        check_error(err, "Couldn't create the GEMM column scales");
+        cl_mem bufC = create_buffer_spilling(CL_MEM_WRITE_ONLY, sizeof(float) * M * N, NULL, &err);
+        check_error(err, "Couldn't create the GEMM output");
+
+        auto device_start = std::chrono::high_resolution_clock::now();
+        gemm_int8_ocl(bufA, bufB, M, N, ld, bufSA, bufSB, bufC);
+        std::chrono::duration<double, std::milli> device_t = std::chrono::high_resolution_clock::now() - device_start;
+        clEnqueueReadBuffer(queue, bufC, CL_TRUE, 0, sizeof(float) * M * N, device_out, 0, NULL, NULL);
+
+        auto host_start = std::chrono::high_resolution_clock::now();
+        perf_begin(); // Start hardware counters for the host GEMM
+        gemm_int8_host(qa, qb, M, N, ld, scale_a, scale_b, host_out);
+        std::chrono::duration<double, std::milli> host_t = std::chrono::high_resolution_clock::now() - host_start;
+        perf_end("gemm_int8_host"); // Print hardware counters for the host GEMM
+
+        // Integer accumulation is exact, so device and host agree; quantization error is checked on one row
+        long mismatches = 0;
+        for (long i = 0; i < (long)M * N; i++) {
+            mismatches += device_out[i] != host_out[i];
+        }
+        double max_rel = 0;
+        for (int n = 0; n < N; n++) {
+            double exact = 0, magnitude = 0;
+            for (int kk = 0; kk < K; kk++) {
+                exact += (double)fa[kk] * fb[(long)n * K + kk];
+                magnitude += fabs((double)fa[kk] * fb[(long)n * K + kk]);
+            }
+            max_rel = fabs(host_out[n] - exact) / magnitude > max_rel ? fabs(host_out[n] - exact) / magnitude : max_rel;
+        }
+        double gops = 2.0 * M * N * K / 1e9;
+        printf("gemm_int8 %dx%dx%d: device %f ms (%.1f GOPS), host %f ms (%.1f GOPS), %ld mismatches, max quantization error %g\n",
+               M, N, K, device_t.count(), gops / (device_t.count() / 1e3), host_t.count(), gops / (host_t.count() / 1e3),
+               mismatches, max_rel);
+
+        deferred_release(bufA);
+        deferred_release(bufB);
+        deferred_release(bufSA);
+        deferred_release(bufSB);
+        deferred_release(bufC);
+        deferred_free(fa);
+        deferred_free(fb);
+        deferred_free(qa);
+        deferred_free(qb);
+        deferred_free(scale_a);
+        deferred_free(scale_b);
+        deferred_free(device_out);
+        deferred_free(host_out);
+    } else if (strcmp(op, "gemv") == 0) {
+        // GEMV and rank-1 updates for both layouts, timed against the bandwidth the plain matrix add reaches
+        int rows, cols;
+        matrix_shape(SZ, &rows, &cols);
+        long count = (long)rows * cols;
+        size_t matrix_bytes = sizeof(float) * count;
+        float *a = (float *)tracked_malloc(matrix_bytes);
+        float *b = (float *)tracked_malloc(matrix_bytes);
+        float *result = (float *)tracked_malloc(matrix_bytes);
+        float *x = (float *)tracked_malloc(sizeof(float) * cols);
+        float *u = (float *)tracked_malloc(sizeof(float) * rows);
+        float *y = (float *)tracked_malloc(sizeof(float) * rows);
+        float *expected = (float *)tracked_malloc(sizeof(float) * rows);
+        for (long i = 0; i < count; i++) {
+            a[i] = v1[i] * 0.01f;
+            b[i] = v2[i] * 0.01f;
+        }
+        for (int c = 0; c < cols; c++) {
+            x[c] = (rand() % 2001 - 1000) / 1000.0f;
+        }
+        for (int r = 0; r < rows; r++) {
+            u[r] = (rand() % 2001 - 1000) / 1000.0f;
+        }
+        const float alpha = 0.5f;
+
+        cl_mem bufA = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, matrix_bytes, a, &err);
+        check_error(err, "Couldn't create the GEMV matrix a");
+        cl_mem bufB = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, matrix_bytes, b, &err);
+        check_error(err, "Couldn't create the GEMV matrix b");
+        cl_mem bufC = create_buffer_spilling(CL_MEM_READ_WRITE, matrix_bytes, NULL, &err);
+        check_error(err, "Couldn't create the GEMV output matrix");
+        cl_mem bufX = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * cols, x, &err);
+        check_error(err, "Couldn't create the GEMV vector x");
+        cl_mem bufU = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * rows, u, &err);
+        check_error(err, "Couldn't create the GEMV vector u");
+        cl_mem bufY = create_buffer_spilling(CL_MEM_WRITE_ONLY, sizeof(float) * rows, NULL, &err);
+        check_error(err, "Couldn't create the GEMV output vector");
+
+        // Reference bandwidth: the f32 matrix add reads two matrices and writes one
+        double add_t = best_time_ms([&] { matrix_add_float_ocl(bufA, bufB, bufC, rows, cols, cols, false, STORAGE_F32); });
+        double bandwidth = 3.0 * matrix_bytes / (add_t / 1e3) / 1e9;
+        printf("gemv %dx%d: matrix add reaches %.2f GB/s\n", rows, cols, bandwidth);
+
+        for (int column_major = 0; column_major < 2; column_major++) {
+            const char *layout = column_major ? "column-major" : "row-major";
+            int ld = column_major ? rows : cols;
+
+            gemv_ocl(bufA, bufX, bufY, rows, cols, ld, column_major);
+            clEnqueueReadBuffer(queue, bufY, CL_TRUE, 0, sizeof(float) * rows, y, 0, NULL, NULL);
+            gemv_host(a, x, expected, rows, cols, ld, column_major);
+            double max_rel = 0;
+            for (int r = 0; r < rows; r++) {
+                double rel = fabs(y[r] - expected[r]) / (fabs(expected[r]) > 1.0 ? fabs(expected[r]) : 1.0);
+                max_rel = rel > max_rel ? rel : max_rel;
+            }
+
+            matrix_add_ger_ocl(bufA, bufB, bufC, bufU, bufX, alpha, rows, cols, ld, column_major);
+            clEnqueueReadBuffer(queue, bufC, CL_TRUE, 0, matrix_bytes, result, 0, NULL, NULL);
+            double max_abs = 0;
+            for (int r = 0; r < rows; r++) {
+                for (int c = 0; c < cols; c++) {
+                    long i = column_major ? (long)c * ld + r : (long)r * ld + c;
+                    double diff = fabs(result[i] - ((double)a[i] + b[i] + (double)alpha * u[r] * x[c]));
+                    max_abs = diff > max_abs ? diff : max_abs;
+                }
+            }
+
+            // The standalone rank-1 update, in place on a copy of a
+            clEnqueueWriteBuffer(queue, bufC, CL_TRUE, 0, matrix_bytes, a, 0, NULL, NULL);
+            ger_ocl(bufC, bufU, bufX, alpha, rows, cols, ld, column_major);
+            clEnqueueReadBuffer(queue, bufC, CL_TRUE, 0, matrix_bytes, result, 0, NULL, NULL);
+            double ger_abs = 0;
+            for (int r = 0; r < rows; r++) {
+                for (int c = 0; c < cols; c++) {
+                    long i = column_major ? (long)c * ld + r : (long)r * ld + c;
+                    double diff = fabs(result[i] - ((double)a[i] + (double)alpha * u[r] * x[c]));
+                    ger_abs = diff > ger_abs ? diff : ger_abs;
+                }
+            }
+
+            // Bytes each kernel has to move at least once
+            double gemv_t = best_time_ms([&] { gemv_ocl(bufA, bufX, bufY, rows, cols, ld, column_major); });
+            double gemv_gbs = (matrix_bytes + sizeof(float) * (rows + cols)) / (gemv_t / 1e3) / 1e9;
+            double ger_t = best_time_ms([&] { ger_ocl(bufC, bufU, bufX, alpha, rows, cols, ld, column_major); });
+            double ger_gbs = 2.0 * matrix_bytes / (ger_t / 1e3) / 1e9;
+            double fused_t = best_time_ms([&] { matrix_add_ger_ocl(bufA, bufB, bufC, bufU, bufX, alpha, rows, cols, ld, column_major); });
+            double fused_gbs = 3.0 * matrix_bytes / (fused_t / 1e3) / 1e9;
+            printf("gemv %s: %f ms, %.2f GB/s (%.0f%% of add), max rel error %g\n",
+                   layout, gemv_t, gemv_gbs, 100.0 * gemv_gbs / bandwidth, max_rel);
+            printf("ger %s: %f ms, %.2f GB/s (%.0f%% of add), max abs error %g\n", layout, ger_t, ger_gbs, 100.0 * ger_gbs / bandwidth, ger_abs);
+            printf("matrix_add_ger %s: %f ms, %.2f GB/s (%.0f%% of add), max abs error %g\n",
+                   layout, fused_t, fused_gbs, 100.0 * fused_gbs / bandwidth, max_abs);
+        }
+
+        deferred_release(bufA);
+        deferred_release(bufB);
+        deferred_release(bufC);
+        deferred_release(bufX);
+        deferred_release(bufU);
+        deferred_release(bufY);
+        deferred_free(a);
+        deferred_free(b);
+        deferred_free(result);
+        deferred_free(x);
+        deferred_free(u);
+        deferred_free(y);
+        deferred_free(expected);
+    } else if (strcmp(op, "reduce") == 0) {
+        // Row sums, column sums and row maxima of a + b for both layouts, as matrix add then reduce and fused
+        int rows, cols;
+        matrix_shape(SZ, &rows, &cols);
+        long count = (long)rows * cols;
+        size_t matrix_bytes = sizeof(float) * count;
+        float *a = (float *)tracked_malloc(matrix_bytes);
+        float *b = (float *)tracked_malloc(matrix_bytes);
+        int lines = rows > cols ? rows : cols;
+        float *result = (float *)tracked_malloc(sizeof(float) * lines);
+        float *expected = (float *)tracked_malloc(sizeof(float) * lines);
+        for (long i = 0; i < count; i++) {
+            a[i] = v1[i] * 0.37f + 0.5f;
+            b[i] = v2[i] * 1.13f - 20.0f;
+        }
+
+        cl_mem bufA = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, matrix_bytes, a, &err);
+        check_error(err, "Couldn't create the reduction matrix a");
+        cl_mem bufB = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, matrix_bytes, b, &err);
+        check_error(err, "Couldn't create the reduction matrix b");
+        cl_mem bufC = create_buffer_spilling(CL_MEM_READ_WRITE, matrix_bytes, NULL, &err);
+        check_error(err, "Couldn't create the reduction sum");
+        cl_mem bufOut = create_buffer_spilling(CL_MEM_WRITE_ONLY, sizeof(float) * lines, NULL, &err);
+        check_error(err, "Couldn't create the reduction output");
+
+        const char *case_names[3] = {"row sums", "column sums", "row maxima"};
+        const bool case_per_row[3] = {true, false, true};
+        const reduce_op case_ops[3] = {REDUCE_SUM, REDUCE_SUM, REDUCE_MAX};
+        for (int column_major = 0; column_major < 2; column_major++) {
+            int ld = column_major ? rows : cols;
+            for (int c = 0; c < 3; c++) {
+                int n = case_per_row[c] ? rows : cols;
+                reduce_axis_host(a, b, expected, rows, cols, ld, column_major, case_per_row[c], case_ops[c]);
+                // Largest error of the reduction left in bufOut against the host reference
+                auto out_error = [&] {
+                    clEnqueueReadBuffer(queue, bufOut, CL_TRUE, 0, sizeof(float) * n, result, 0, NULL, NULL);
+                    double max_rel = 0;
+                    for (int i = 0; i < n; i++) {
+                        double rel = fabs(result[i] - expected[i]) / (fabs(expected[i]) > 1.0 ? fabs(expected[i]) : 1.0);
+                        max_rel = rel > max_rel ? rel : max_rel;
+                    }
+                    return max_rel;
+                };
+                double separate_t = best_time_ms([&] {
+                    matrix_add_float_ocl(bufA, bufB, bufC, rows, cols, ld, column_major, STORAGE_F32);
+                    reduce_axis_ocl(bufC, NULL, bufOut, rows, cols, ld, column_major, case_per_row[c], case_ops[c]);
+                });
+                double separate_rel = out_error();
+                double fused_t = best_time_ms([&] {
+                    reduce_axis_ocl(bufA, bufB, bufOut, rows, cols, ld, column_major, case_per_row[c], case_ops[c]);
+                });
+                double fused_rel = out_error();
+                printf("reduce %s %s: add then reduce %f ms (max rel error %g), fused %f ms (max rel error %g)\n",
+                       column_major ? "column-major" : "row-major", case_names[c], separate_t, separate_rel, fused_t, fused_rel);
+            }
+        }
+
+        deferred_release(bufA);
+        deferred_release(bufB);
+        deferred_release(bufC);
+        deferred_release(bufOut);
+        deferred_free(a);
+        deferred_free(b);
+        deferred_free(result);
+        deferred_free(expected);
+    } else if (strcmp(op, "stencil") == 0) {
+        // Moving sums over the add result for radii up to STENCIL_MAX_RADIUS, with every vector width. The odd radii
+        // leave the halo and the vector loads unaligned to the tile.
+        float *signal = (float *)tracked_malloc(sizeof(float) * SZ);
+        float *result = (float *)tracked_malloc(sizeof(float) * SZ);
+        float *expected = (float *)tracked_malloc(sizeof(float) * SZ);
+        float coeffs[2 * STENCIL_MAX_RADIUS + 1];
+        for (long i = 0; i < SZ; i++) {
+            signal[i] = v_out[i] * 0.01f;
+        }
+        for (int j = 0; j < 2 * STENCIL_MAX_RADIUS + 1; j++) {
+            coeffs[j] = 1.0f;
+        }
+        cl_mem bufIn = create_buffer_spilling(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * SZ, signal, &err);
+        check_error(err, "Couldn't create the stencil input");
+        cl_mem bufOut = create_buffer_spilling(CL_MEM_WRITE_ONLY, sizeof(float) * SZ, NULL, &err);
+        check_error(err, "Couldn't create the stencil output");
+
+        int check = SZ < 2 * STENCIL_CHECK ? SZ : STENCIL_CHECK;
+        int chosen = stencil_width();
+        printf("stencil: chosen vector width %d\n", chosen);
+        const int radii[] = {1, 2, 3, 4, 5, 7, 8, 13, 16, 31, 32, 33, STENCIL_MAX_RADIUS};
+        for (int radius : radii) {
+            printf("stencil radius %2d:", radius);
+            for (int width = 1; width <= 16; width *= 2) {
+                double t = best_time_ms([&] { stencil_ocl(bufIn, bufOut, SZ, radius, coeffs, width); });
+                printf(" w%d %.3f ms (%.1f GB/s)%s", width, t, 2.0 * sizeof(float) * SZ / (t / 1e3) / 1e9, width == chosen ? "*" : "");
+            }
+
+            // Check the chosen width at both ends of the signal, where the halos are clipped
+            stencil_ocl(bufIn, bufOut, SZ, radius, coeffs, 0);
+            clEnqueueReadBuffer(queue, bufOut, CL_TRUE, 0, sizeof(float) * SZ, result, 0, NULL, NULL);
+            stencil_host(signal, expected, SZ, 0, check, radius, coeffs);
+            stencil_host(signal, expected, SZ, SZ - check, SZ, radius, coeffs);
+            double max_rel = 0;
+            for (int end = 0; end < 2; end++) {
+                for (int i = end ? SZ - check : 0; i < (end ? SZ : check); i++) {
+                    double rel = fabs(result[i] - expected[i]) / (fabs(expected[i]) > 1.0 ? fabs(expected[i]) : 1.0);
+                    max_rel = rel > max_rel ? rel : max_rel;
+                }
+            }
+            printf(", max rel error %g\n", max_rel);
+        }
+
+        deferred_release(bufIn);
+        deferred_release(bufOut);
+        deferred_free(signal);
+        deferred_free(result);
+        deferred_free(expected);
+    } else if (strcmp(op, "math") == 0) {
+        // Error and speed of every tier, then the tier chosen for a few error budgets applied to SZ inputs
+        calibrate_math();
+        printf("math: device transfers add %.3f ns per element\n", math_transfer_ns);
+        for (int f = 0; f < MATH_FUNCS; f++) {
+            printf("math %-7s:", math_func_names[f]);
+            for (int tier = 0; tier < MATH_TIERS; tier++) {
+                printf(" %s %.3f ns (error %.2g)", math_tier_names[tier], math_ns[f][tier], math_error[f][tier]);
+            }
+            printf("\n");
+        }
+
+        float *in = (float *)tracked_malloc(sizeof(float) * SZ);
+        float *out = (float *)tracked_malloc(sizeof(float) * SZ);
+        const double budgets[3] = {1e-2, 1e-4, 1e-6};
+        for (int f = 0; f < MATH_FUNCS; f++) {
+            for (long i = 0; i < SZ; i++) {
+                in[i] = math_input((math_func)f, i, SZ);
+            }
+            for (int b = 0; b < 3; b++) {
+                auto op_start = std::chrono::high_resolution_clock::now();
+                math_tier tier = apply_math((math_func)f, in, out, SZ, budgets[b]);
+                std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - op_start;
+                double max_error = 0;
+                for (long i = 0; i < SZ; i += SZ / MATH_PROBE + 1) {
+                    double error = math_error_of(out[i], math_reference((math_func)f, in[i]));
+                    max_error = error > max_error ? error : max_error;
+                }
+                printf("math %s within %g: %s tier, %f ms, sampled error %.2g\n",
+                       math_func_names[f], budgets[b], math_tier_names[tier], t.count(), max_error);
+            }
+        }
+        deferred_free(in);
+        deferred_free(out);
+    } else if (strcmp(op, "independent") == 0) {
+        // Four ops with separate outputs, run one after another on the first queue, then spread across the pool
+        const int hist_bins = 199, index_bins = 100;
+        int serial_hist[hist_bins], batch_hist[hist_bins], serial_index[index_bins], batch_index[index_bins];
+        int serial_sums[index_bins], batch_sums[index_bins];
+        int zero = 0;
+        int *serial_gather = (int *)tracked_malloc(sizeof(int) * SZ);
+        int *batch_gather = (int *)tracked_malloc(sizeof(int) * SZ);
+        cl_mem bufGather = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * SZ, NULL, &err);
+        check_error(err, "Couldn't create the independent gather output");
+        cl_mem bufHist = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * hist_bins, NULL, &err);
+        check_error(err, "Couldn't create the independent histogram");
+        cl_mem bufIndex = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * index_bins, NULL, &err);
+        check_error(err, "Couldn't create the independent index histogram");
+        cl_mem bufSums = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * index_bins, NULL, &err);
+        check_error(err, "Couldn't create the independent scatter-add sums");
+
+        double times[2];
+        for (int batched = 0; batched < 2; batched++) {
+            auto op_start = std::chrono::high_resolution_clock::now();
+            if (batched) {
+                begin_pool_batch();
+                next_batch_op(SZ);
+            }
+            gather_ocl(bufV1, bufV2, bufGather, SZ);
+            if (batched) {
+                next_batch_op(SZ);
+            }
+            histogram_ocl(bufV_out, SZ, bufHist, hist_bins, 0);
+            if (batched) {
+                next_batch_op(SZ);
+            }
+            histogram_ocl(bufV1, SZ, bufIndex, index_bins, 0);
+            if (batched) {
+                next_batch_op(SZ);
+            }
+            clEnqueueFillBuffer(queue, bufSums, &zero, sizeof(int), 0, sizeof(int) * index_bins, 0, NULL, NULL);
+            scatter_add_ocl(bufV1, bufV2, bufSums, SZ, index_bins);
+            if (batched) {
+                end_pool_batch();
+            }
+            std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - op_start;
+            times[batched] = t.count();
+
+            check_error(clEnqueueReadBuffer(queue, bufGather, CL_TRUE, 0, sizeof(int) * SZ, batched ? batch_gather : serial_gather, 0, NULL, NULL),
+                        "Couldn't read the gather output");
+            check_error(clEnqueueReadBuffer(queue, bufHist, CL_TRUE, 0, sizeof(int) * hist_bins, batched ? batch_hist : serial_hist, 0, NULL, NULL),
+                        "Couldn't read the histogram");
+            check_error(clEnqueueReadBuffer(queue, bufIndex, CL_TRUE, 0, sizeof(int) * index_bins, batched ? batch_index : serial_index, 0, NULL, NULL),
+                        "Couldn't read the index histogram");
+            check_error(clEnqueueReadBuffer(queue, bufSums, CL_TRUE, 0, sizeof(int) * index_bins, batched ? batch_sums : serial_sums, 0, NULL, NULL),
+                        "Couldn't read the scatter-add output");
+        }
+
+        long mismatches = 0;
+        for (long i = 0; i < SZ; i++) {
+            mismatches += serial_gather[i] != batch_gather[i] || batch_gather[i] != v2[v1[i]];
+        }
+        for (int b = 0; b < hist_bins; b++) {
+            mismatches += serial_hist[b] != batch_hist[b];
+        }
+        for (int b = 0; b < index_bins; b++) {
+            mismatches += serial_index[b] != batch_index[b] || serial_sums[b] != batch_sums[b];
+        }
+        printf("independent: one queue %f ms, %d queues %f ms, %ld mismatches\n", times[0], NUM_QUEUES, times[1], mismatches);
+
+        deferred_release(bufGather);
+        deferred_release(bufHist);
+        deferred_release(bufIndex);
+        deferred_release(bufSums);
+        deferred_free(serial_gather);
+        deferred_free(batch_gather);
+    } else if (strcmp(op, "steady") == 0) {
+        // Repeat the add through the device backend and fail if any repetition allocates through tracked_malloc(), a
+        // tracked buffer or operator new. The host code allocates only through those; allocations the OpenCL driver
+        // and the C library make internally are not seen. The add enqueues without events, so it asks the driver
+        // for no event objects either.
+        device_backend.add(dev_v1, dev_v2, dev_v_out, SZ); // Any first-use allocations happen here
+        long set_before = kernel_args_set, skipped_before = kernel_args_skipped;
+        auto op_start = std::chrono::high_resolution_clock::now();
+        for (int rep = 0; rep < STEADY_REPS; rep++) {
+            size_t allocs_before = total_alloc_count();
+            device_backend.add(dev_v1, dev_v2, dev_v_out, SZ);
+            if (total_alloc_count() != allocs_before) {
+                printf("steady: add %d made %zu allocations\n", rep, total_alloc_count() - allocs_before);
+                exit(1);
+            }
+        }
+        std::chrono::duration<double, std::micro> t = std::chrono::high_resolution_clock::now() - op_start;
+        printf("steady: %d adds with no tracked host, buffer or operator new allocations, %ld kernel args set, %ld skipped, %f us per add\n",
+               STEADY_REPS, kernel_args_set - set_before, kernel_args_skipped - skipped_before, t.count() / STEADY_REPS);
+    } else if (strcmp(op, "backends") == 0) {
+        // The same add, gather and scatter on every backend, the add checked against the add result in v_out
+        ocl_buffer_backend ocl_buffers;
+        ocl_svm_backend ocl_svm;
+        native_backend native;
+        reference_backend reference;
+        check_backend_add(ocl_buffers);
+        check_backend_add(ocl_svm);
+        check_backend_add(native);
+        check_backend_add(reference);
+        check_backend_gather_scatter(ocl_buffers);
+        check_backend_gather_scatter(ocl_svm);
+        check_backend_gather_scatter(native);
+        check_backend_gather_scatter(reference);
+    } else if (strcmp(op, "spill") == 0) {
+        // SPILL_VECTORS vectors of SZ ints, each added in place to the next one on the device for SPILL_ROUNDS
+        // passes. When they do not fit the budget (see DEVICE_BUDGET_MB) vectors are evicted and re-uploaded.
+        int *vecs[SPILL_VECTORS];
+        int handles[SPILL_VECTORS];
+        for (int k = 0; k < SPILL_VECTORS; k++) {
+            vecs[k] = (int *)tracked_malloc(sizeof(int) * SZ);
+            for (long i = 0; i < SZ; i++) {
+                vecs[k][i] = v1[i] + k;
+            }
+            handles[k] = manage_vector(vecs[k], sizeof(int) * SZ);
+        }
+        long evictions = managed_evictions;
+        long uploads = managed_uploads;
+
+        auto op_start = std::chrono::high_resolution_clock::now();
+        cl_kernel k_add = get_kernel("vector_add_ocl");
+        for (int round = 0; round < SPILL_ROUNDS; round++) {
+            for (int k = 0; k < SPILL_VECTORS; k++) {
+                begin_managed_op();
+                cl_mem a = acquire_vector(handles[k], true, true);
+                cl_mem b = acquire_vector(handles[(k + 1) % SPILL_VECTORS], true, false);
+                set_kernel_arg(k_add, 0, sizeof(int), &SZ);
+                set_kernel_arg(k_add, 1, sizeof(cl_mem), &a);
+                set_kernel_arg(k_add, 2, sizeof(cl_mem), &b);
+                set_kernel_arg(k_add, 3, sizeof(cl_mem), &a);
+                run_kernel(k_add, round_up(SZ, OP_LOCAL_SIZE), OP_LOCAL_SIZE);
+            }
+        }
+        for (int k = 0; k < SPILL_VECTORS; k++) {
+            sync_vector(handles[k]);
+        }
+        std::chrono::duration<double, std::milli> t = std::chrono::high_resolution_clock::now() - op_start;
+
+        // Replay the same adds on the host one element at a time
+        long mismatches = 0;
+        for (long i = 0; i < SZ; i++) {
+            int x[SPILL_VECTORS];
+            for (int k = 0; k < SPILL_VECTORS; k++) {
+                x[k] = v1[i] + k;
+            }
+            for (int round = 0; round < SPILL_ROUNDS; round++) {
+                for (int k = 0; k < SPILL_VECTORS; k++) {
+                    x[k] += x[(k + 1) % SPILL_VECTORS];
+                }
+            }
+            for (int k = 0; k < SPILL_VECTORS; k++) {
+                mismatches += vecs[k][i] != x[k];
+            }
+        }
+        printf("spill: %d x %.1f MB vectors, budget %.1f MB, %f ms, %ld evictions, %ld uploads, %ld mismatches\n",
+               SPILL_VECTORS, sizeof(int) * SZ / 1048576.0, get_device_budget() / 1048576.0, t.count(),
+               managed_evictions - evictions, managed_uploads - uploads, mismatches);
+        for (int k = 0; k < SPILL_VECTORS; k++) {
+            unmanage_vector(handles[k]);
+            deferred_free(vecs[k]);
+        }
+    } else if (strcmp(op, "occupancy") == 0) {
+        // The add kernel at every local size from MIN_LOCAL_SIZE up: pruned candidates are reported with the reason,
+        // the others are profiled. Then the resource use of the other op kernels at OP_LOCAL_SIZE. Those are not
+        // profiled: their arguments (index, bin and packed buffers, __local sizes) are set up by their own ops, and
+        // a launch with missing or stale arguments would time nothing meaningful.
+        const char *add_name = use_streaming_stores(SZ) ? "vector_add_nt_ocl" : "vector_add_ocl";
+        size_t global_size = use_streaming_stores(SZ) ? (size_t)(SZ + 3) / 4 : (size_t)SZ;
+        kernel_resources r = query_kernel_resources(kernel);
+        for (size_t local_size = MIN_LOCAL_SIZE; local_size <= r.work_group_size * 2; local_size *= 2) {
+            const char *reason = prune_local_size(r, local_size);
+            if (reason != NULL) {
+                printf("occupancy %s local %zu: pruned, %s\n", add_name, local_size, reason);
+                continue;
+            }
+            print_kernel_report(add_name, kernel, local_size, profile_kernel_ms(kernel, round_up(global_size, local_size), local_size));
+        }
+
+        const char *names[] = {"gather_ocl", "scatter_add_local_ocl", "histogram_local_ocl", "scan_block_ocl",
+                               "topk_local_ocl", "count_above_ocl", "decode_add_pack_ocl", "gemm_int8_ocl",
+                               "gemv_rows_ocl", "sum_rows", "exp_full", "exp_native"};
+        for (const char *name : names) {
+            print_kernel_report(name, get_kernel(name), OP_LOCAL_SIZE, -1);
+        }
+    } else {
+        printf("Unknown vector op: %s\n", op);
+    }
+}
+
+// Function definition for the reclaim thread's loop: make queued releases until reclaim_shutdown() and the queue is empty
+void reclaim_worker() {
+    std::unique_lock<std::mutex> lock(reclaim_mutex);
+    while (true) {
+        reclaim_ready.wait(lock, [] { return reclaim_count > 0 || reclaim_stop; });
+        if (reclaim_count == 0) {
+            return;
+        }
+        reclaim_item item = reclaim_queue[reclaim_head];
+        reclaim_head = (reclaim_head + 1) % RECLAIM_QUEUE;
+        reclaim_count--;
+        reclaim_busy = true;
+
+        lock.unlock(); // munmap and driver teardown run without holding up producers
+        if (item.buffer != NULL) {
+            clReleaseMemObject(item.buffer);
+        } else {
+            free(item.block);
+        }
+        lock.lock();
+        reclaim_busy = false;
+        if (reclaim_count == 0) {
+            reclaim_idle.notify_all();
+        }
+    }
+}
+
+// Function definition for queueing a release on the reclaim thread, false if the queue is full
+bool reclaim_push(reclaim_item item) {
+    std::lock_guard<std::mutex> lock(reclaim_mutex);
+    if (!reclaim_thread.joinable()) {
+        reclaim_thread = std::thread(reclaim_worker);
+        atexit(reclaim_shutdown); // Runs before print_alloc_summary, which was registered first
+    }
+    if (reclaim_count == RECLAIM_QUEUE) {
+        return false;
+    }
+    reclaim_queue[(reclaim_head + reclaim_count) % RECLAIM_QUEUE] = item;
+    reclaim_count++;
+    reclaim_ready.notify_one();
+    return true;
+}
+
+// Function definition for finishing the queued releases and stopping the reclaim thread, registered with atexit().
+// main() calls it first to time the join, so the atexit() call finds the thread already joined.
+void reclaim_shutdown() {
+    if (!reclaim_thread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(reclaim_mutex);
+        reclaim_stop = true;
+    }
+    reclaim_ready.notify_one();
+    reclaim_thread.join();
+}
+
+// Function definition for waiting until the reclaim thread has made every queued release, so memory the
+// statistics already count as free is really back with the driver
+void reclaim_drain() {
+    std::unique_lock<std::mutex> lock(reclaim_mutex);
+    reclaim_idle.wait(lock, [] { return reclaim_count == 0 && !reclaim_busy; });
+}
+
+// Function definition for queueing a host block for free() on the reclaim thread, used by deferred_free()
+bool reclaim_free_block(void *block) {
+    return reclaim_push({block, NULL});
+}
+
+// Function definition for releasing a tracked OpenCL buffer, buffers of RECLAIM_MIN_BYTES or more on the reclaim thread
+void deferred_release(cl_mem buf) {
+    size_t bytes = 0;
+    clGetMemObjectInfo(buf, CL_MEM_SIZE, sizeof(bytes), &bytes, NULL);
+    if (bytes < RECLAIM_MIN_BYTES) {
+        tracked_clReleaseMemObject(buf);
+        return;
+    }
+    record_free(device_alloc_stats, "device", bytes);
+    if (!reclaim_push({NULL, buf})) {
+        clReleaseMemObject(buf);
+    }
+}
+
+// Function definition for ending the process without teardown: the OS reclaims the host memory, and the driver
+// the device buffers, queues and context, faster than releasing them one by one
+void fast_exit() {
+    print_alloc_summary(); // atexit() handlers are skipped by _exit()
+    fflush(stdout);
+    _exit(0);
+}
+
+// Function definition for c = a + b on a backend: the inputs are uploaded, the add is timed as the fastest of
+// BENCH_REPS runs and the result is downloaded. Returns the add time in ms.
+template <typename B>
+double backend_add(backend<B> &be, const int *a, const int *b, int *c, int size) {
+    backend_buffer buf_a = be.alloc(size);
+    backend_buffer buf_b = be.alloc(size);
+    backend_buffer buf_c = be.alloc(size);
+    be.upload(buf_a, a, size);
+    be.upload(buf_b, b, size);
+    double ms = best_time_ms([&] { be.add(buf_a, buf_b, buf_c, size); });
+    be.download(c, buf_c, size);
+    be.release(buf_a);
+    be.release(buf_b);
+    be.release(buf_c);
+    return ms;
+}
+
+// Function definition for timing the add of v1 and v2 on a backend and checking it against v_out
+template <typename B>
+void check_backend_add(backend<B> &be) {
+    if (!be.available()) {
+        printf("backend %-13s: not supported by the device\n", be.name());
+        return;
+    }
+    int *result = (int *)tracked_malloc(sizeof(int) * SZ);
+    double ms = backend_add(be, v1, v2, result, SZ);
+    long mismatches = 0;
+    for (long i = 0; i < SZ; i++) {
+        mismatches += result[i] != v_out[i];
+    }
+    printf("backend %-13s: %f ms, %.2f GB/s, %ld mismatches\n", be.name(), ms, 3.0 * sizeof(int) * SZ / ms / 1e6, mismatches);
+    deferred_free(result);
+}
+
+// Function definition for gathering v2 by the indices in v1 on a backend, then scattering v2 to them into a
+// 100-element output, each checked on the host
+template <typename B>
+void check_backend_gather_scatter(backend<B> &be) {
+    if (!be.available()) {
+        return;
+    }
+    const int out_size = 100;
+    int scattered[out_size];
+    int zero[out_size] = {0};
+    int *result = (int *)tracked_malloc(sizeof(int) * SZ);
+    backend_buffer buf_idx = be.alloc(SZ);
+    backend_buffer buf_values = be.alloc(SZ);
+    backend_buffer buf_out = be.alloc(SZ);
+    be.upload(buf_idx, v1, SZ);
+    be.upload(buf_values, v2, SZ);
+
+    double gather_ms = best_time_ms([&] { be.gather(buf_idx, buf_values, buf_out, SZ); });
+    be.download(result, buf_out, SZ);
+    long gather_mismatches = 0;
+    for (long i = 0; i < SZ; i++) {
+        gather_mismatches += result[i] != v2[v1[i]];
+    }
+
+    be.upload(buf_out, zero, out_size);
+    double scatter_ms = best_time_ms([&] { be.scatter(buf_idx, buf_values, buf_out, SZ); });
+    be.download(scattered, buf_out, out_size);
+    long scatter_mismatches_count = scatter_mismatches(scattered, v1, v2, SZ, out_size);
+
+    printf("backend %-13s: gather %f ms, %ld mismatches, scatter %f ms, %ld mismatches\n", be.name(), gather_ms,
+           gather_mismatches, scatter_ms, scatter_mismatches_count);
+    be.release(buf_idx);
+    be.release(buf_values);
+    be.release(buf_out);
+    deferred_free(result);
+}
+
+// Function definition for allocating a device buffer for the OpenCL buffer backend
+backend_buffer ocl_buffer_backend::alloc_impl(int size) {
+    cl_int status;
+    cl_mem mem = create_buffer_spilling(CL_MEM_READ_WRITE, sizeof(int) * size, NULL, &status);
+    check_error(status, "Couldn't create a backend buffer");
+    return {mem, NULL, sizeof(int) * size, -1};
+}
+
+// Function definition for wrapping a host vector: it is registered with the device memory manager and starts
+// evicted, so the host copy is current
+backend_buffer ocl_buffer_backend::wrap_impl(int *host, int size) {
+    return {NULL, host, sizeof(int) * size, manage_vector(host, sizeof(int) * size)};
+}
+
+// Function definition for getting the device buffer of a backend buffer. A wrapped vector is acquired for the
+// current op: read uploads it if it is not resident, write marks the device copy as the newer one.
+cl_mem ocl_buffer_backend::device_mem(const backend_buffer &buf, bool read, bool write) {
+    return buf.managed >= 0 ? acquire_vector(buf.managed, read, write) : buf.mem;
+}
+
+// Function definition for copying host data into a device buffer
+void ocl_buffer_backend::upload_impl(backend_buffer &dst, const int *src, int size) {
+    check_error(clEnqueueWriteBuffer(queue, device_mem(dst, false, false), CL_TRUE, 0, sizeof(int) * size, src, 0, NULL, NULL),
+                "Couldn't write a backend buffer");
+    if (dst.managed >= 0) {
+        managed[dst.managed].device_dirty = src != dst.ptr; // Uploading the wrapped vector itself leaves both copies equal
+        managed_uploads++;
+    }
+}
+
+// Function definition for copying a device buffer back to the host. A wrapped vector is brought up to date first.
+void ocl_buffer_backend::download_impl(int *dst, const backend_buffer &src, int size) {
+    if (src.managed >= 0) {
+        sync_vector(src.managed); // Evicted vectors were written back already
+        if (dst != src.ptr) {
+            memcpy(dst, src.ptr, sizeof(int) * size);
+        }
+        return;
+    }
+    check_error(clEnqueueReadBuffer(queue, src.mem, CL_TRUE, 0, sizeof(int) * size, dst, 0, NULL, NULL),
+                "Couldn't read a backend buffer");
+}
+
+// Function definition for adding device buffers split across the queue pool. Outputs larger than the cache use
+// the streaming kernel, like the add kernel chosen at startup, so both share the cached kernel and its arguments.
+void ocl_buffer_backend::add_impl(const backend_buffer &a, const backend_buffer &b, backend_buffer &c, int size) {
+    cl_mem mem_a = device_mem(a, true, false);
+    cl_mem mem_b = device_mem(b, true, false);
+    cl_mem mem_c = device_mem(c, false, true);
+    bool streaming = use_streaming_stores(size);
+    cl_kernel k = get_kernel(streaming ? "vector_add_nt_ocl" : "vector_add_ocl");
+    set_kernel_arg(k, 0, sizeof(int), &size);
+    set_kernel_arg(k, 1, sizeof(cl_mem), &mem_a);
+    set_kernel_arg(k, 2, sizeof(cl_mem), &mem_b);
+    set_kernel_arg(k, 3, sizeof(cl_mem), &mem_c);
+    int count = enqueue_ndrange_pooled(k, streaming ? (size_t)(size + 3) / 4 : (size_t)size, NUM_QUEUES, pool_used);
+    finish_queues(pool_used, count);
+}
+
+// Function definition for gathering device buffers with gather_ocl()
+void ocl_buffer_backend::gather_impl(const backend_buffer &idx, const backend_buffer &src, backend_buffer &out, int size) {
+    cl_mem mem_idx = device_mem(idx, true, false);
+    cl_mem mem_src = device_mem(src, true, false);
+    gather_ocl(mem_idx, mem_src, device_mem(out, false, true), size);
+}
+
+// Function definition for scattering device buffers with scatter_ocl(); out keeps the elements nothing is scattered to
+void ocl_buffer_backend::scatter_impl(const backend_buffer &idx, const backend_buffer &values, backend_buffer &out, int size) {
+    cl_mem mem_idx = device_mem(idx, true, false);
+    cl_mem mem_values = device_mem(values, true, false);
+    scatter_ocl(mem_idx, mem_values, device_mem(out, true, true), size);
+}
+
+// Function definition for releasing a device buffer
+void ocl_buffer_backend::release_impl(backend_buffer &buf) {
+    deferred_release(buf.mem);
+}
+
+// Function definition for dropping a wrapped vector from the device memory manager, releasing its device buffer
+void ocl_buffer_backend::unwrap_impl(backend_buffer &buf) {
+    unmanage_vector(buf.managed);
+    buf.managed = -1;
+}
+
+// Function definition for checking that the device supports coarse-grained shared virtual memory (OpenCL 2.0)
+bool ocl_svm_backend::available_impl() {
+    cl_device_svm_capabilities caps = 0;
+    if (clGetDeviceInfo(device_id, CL_DEVICE_SVM_CAPABILITIES, sizeof(caps), &caps, NULL) != CL_SUCCESS) {
+        return false;
+    }
+    return (caps & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER) != 0;
+}
+
+// Function definition for allocating shared virtual memory, counted with the device buffers
+backend_buffer ocl_svm_backend::alloc_impl(int size) {
+    int *ptr = (int *)clSVMAlloc(context, CL_MEM_READ_WRITE, sizeof(int) * size, 0);
+    if (ptr == NULL) {
+        printf("Couldn't allocate shared virtual memory\n");
+        exit(1);
+    }
+    record_alloc(device_alloc_stats, "device", sizeof(int) * size);
+    return {NULL, ptr, sizeof(int) * size, -1};
+}
+
+// Function definition for wrapping a host vector in a copy in shared virtual memory
+backend_buffer ocl_svm_backend::wrap_impl(int *host, int size) {
+    backend_buffer buf = alloc_impl(size);
+    upload_impl(buf, host, size);
+    return buf;
+}
+
+// Function definition for copying host data into shared virtual memory
+void ocl_svm_backend::upload_impl(backend_buffer &dst, const int *src, int size) {
+    check_error(clEnqueueSVMMemcpy(queue, CL_TRUE, dst.ptr, src, sizeof(int) * size, 0, NULL, NULL),
+                "Couldn't write shared virtual memory");
+}
+
+// Function definition for copying shared virtual memory back to the host
+void ocl_svm_backend::download_impl(int *dst, const backend_buffer &src, int size) {
+    check_error(clEnqueueSVMMemcpy(queue, CL_TRUE, dst, src.ptr, sizeof(int) * size, 0, NULL, NULL),
+                "Couldn't read shared virtual memory");
+}
+
+// Function definition for running a kernel taking a size and three buffers on shared virtual memory
+void ocl_svm_backend::run_impl(const char *name, const backend_buffer &a, const backend_buffer &b, const backend_buffer &c, int size) {
+    cl_kernel k = get_kernel(name);
+    check_error(clSetKernelArgSVMPointer(k, 1, a.ptr), "Couldn't set an SVM kernel argument");
+    check_error(clSetKernelArgSVMPointer(k, 2, b.ptr), "Couldn't set an SVM kernel argument");
+    check_error(clSetKernelArgSVMPointer(k, 3, c.ptr), "Couldn't set an SVM kernel argument");
+    forget_kernel_args(k); // set_kernel_arg() does not see SVM pointers, so it must not skip the next cl_mem arguments
+    set_kernel_arg(k, 0, sizeof(int), &size);
+    run_kernel(k, round_up(size, OP_LOCAL_SIZE), OP_LOCAL_SIZE);
+}
+
+// Function definition for adding shared virtual memory with vector_add_ocl
+void ocl_svm_backend::add_impl(const backend_buffer &a, const backend_buffer &b, backend_buffer &c, int size) {
+    run_impl("vector_add_ocl", a, b, c, size);
+}
+
+// Function definition for gathering shared virtual memory with gather_ocl
+void ocl_svm_backend::gather_impl(const backend_buffer &idx, const backend_buffer &src, backend_buffer &out, int size) {
+    run_impl("gather_ocl", idx, src, out, size);
+}
+
+// Function definition for scattering shared virtual memory with scatter_ocl
+void ocl_svm_backend::scatter_impl(const backend_buffer &idx, const backend_buffer &values, backend_buffer &out, int size) {
+    run_impl("scatter_ocl", idx, values, out, size);
+}
+
+// Function definition for freeing shared virtual memory
+void ocl_svm_backend::release_impl(backend_buffer &buf) {
+    clSVMFree(context, buf.ptr);
+    record_free(device_alloc_stats, "device", buf.bytes);
+}
+
+// Function definition for freeing the copy of a wrapped host vector
+void ocl_svm_backend::unwrap_impl(backend_buffer &buf) {
+    release_impl(buf);
+}
+
+// Function definition for adding host vectors with add_host() on every host thread
+void native_backend::add_impl(const backend_buffer &a, const backend_buffer &b, backend_buffer &c, int size) {
+    const backend_buffer *args[3] = {&a, &b, &c};
+    parallel_for(size, [](int begin, int end, void *arg) {
+        const backend_buffer **bufs = (const backend_buffer **)arg;
+        add_host(bufs[0]->ptr + begin, bufs[1]->ptr + begin, bufs[2]->ptr + begin, end - begin);
+    }, args);
+}
+
+// Function definition for gathering host vectors on every host thread
+void native_backend::gather_impl(const backend_buffer &idx, const backend_buffer &src, backend_buffer &out, int size) {
+    const backend_buffer *args[3] = {&idx, &src, &out};
+    parallel_for(size, [](int begin, int end, void *arg) {
+        const backend_buffer **bufs = (const backend_buffer **)arg;
+        for (int i = begin; i < end; i++) {
+            bufs[2]->ptr[i] = bufs[1]->ptr[bufs[0]->ptr[i]];
+        }
+    }, args);
+}
+
+// Function definition for scattering host vectors on every host thread; colliding indices keep an arbitrary value
+void native_backend::scatter_impl(const backend_buffer &idx, const backend_buffer &values, backend_buffer &out, int size) {
+    const backend_buffer *args[3] = {&idx, &values, &out};
+    parallel_for(size, [](int begin, int end, void *arg) {
+        const backend_buffer **bufs = (const backend_buffer **)arg;
+        for (int i = begin; i < end; i++) {
+            __atomic_store_n(&bufs[2]->ptr[bufs[0]->ptr[i]], bufs[1]->ptr[i], __ATOMIC_RELAXED);
+        }
+    }, args);
+}
+
+// Function definition for adding host vectors with a scalar loop
+void reference_backend::add_impl(const backend_buffer &a, const backend_buffer &b, backend_buffer &c, int size) {
+    for (int i = 0; i < size; i++) {
+        c.ptr[i] = a.ptr[i] + b.ptr[i];
+    }
+}
+
+// Function definition for gathering host vectors with a scalar loop
+void reference_backend::gather_impl(const backend_buffer &idx, const backend_buffer &src, backend_buffer &out, int size) {
+    for (int i = 0; i < size; i++) {
+        out.ptr[i] = src.ptr[idx.ptr[i]];
+    }
+}
+
+// Function definition for scattering host vectors with a scalar loop
+void reference_backend::scatter_impl(const backend_buffer &idx, const backend_buffer &values, backend_buffer &out, int size) {
+    for (int i = 0; i < size; i++) {
+        out.ptr[idx.ptr[i]] = values.ptr[i];
+    }
+}
+
+// Function definition for getting the device memory budget: a fraction of CL_DEVICE_GLOBAL_MEM_SIZE, or
+// DEVICE_BUDGET_MB if it is set. All tracked device buffers count against it, not only managed vectors.
+size_t get_device_budget() {
+    if (device_budget == 0 && DEVICE_BUDGET_MB > 0) {
+        device_budget = (size_t)DEVICE_BUDGET_MB * 1024 * 1024;
+    } else if (device_budget == 0) {
+        cl_ulong global_mem = 0;
+        check_error(clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL),
+                    "Couldn't query the device memory size");
+        device_budget = (size_t)(global_mem * DEVICE_BUDGET_FRACTION);
+    }
+    return device_budget;
+}
+
+// Function definition for registering a host vector with the device memory manager, returns its handle.
+// The vector starts evicted; acquire_vector() makes it resident.
+int manage_vector(void *host, size_t bytes) {
+    for (int v = 0; v < MAX_MANAGED; v++) {
+        if (managed[v].host == NULL) {
+            managed[v] = {host, bytes, NULL, false, managed_clock};
+            return v;
+        }
+    }
+    printf("Couldn't register a vector: the device memory manager tracks at most %d\n", MAX_MANAGED);
+    exit(1);
+}
+
+// Function definition for starting an op: vectors acquired by earlier ops become candidates for eviction
+void begin_managed_op() {
+    managed_clock++;
+}
+
+// Function definition for evicting the least recently used resident vector not acquired in the current op,
+// writing it back to the host first if the device changed it. Returns false if there is nothing to evict.
+bool evict_vector() {
+    int victim = -1;
+    for (int v = 0; v < MAX_MANAGED; v++) {
+        if (managed[v].mem != NULL && managed[v].last_used != managed_clock &&
+            (victim < 0 || managed[v].last_used < managed[victim].last_used)) {
+            victim = v;
+        }
+    }
+    if (victim < 0) {
+        return false;
+    }
+    managed_vector &m = managed[victim];
+    if (m.device_dirty) {
+        check_error(clEnqueueReadBuffer(queue, m.mem, CL_TRUE, 0, m.bytes, m.host, 0, NULL, NULL),
+                    "Couldn't write back an evicted vector");
+        m.device_dirty = false;
+    }
+
+    // The global handles of v1, v2 and v_out must not outlive the buffer; run_vector_op() acquires them again
+    if (bufV1 == m.mem) {
+        bufV1 = NULL;
+    }
+    if (bufV2 == m.mem) {
+        bufV2 = NULL;
+    }
+    if (bufV_out == m.mem) {
+        bufV_out = NULL;
+    }
+    tracked_clReleaseMemObject(m.mem); // Released here, not on the reclaim thread, so the room exists on return
+    m.mem = NULL;
+    managed_evictions++;
+    return true;
+}
+
+// Function definition for creating a device buffer like tracked_clCreateBuffer(), evicting vectors first while
+// the budget would be exceeded. If the driver still reports the allocation failing, the releases pending on the
+// reclaim thread are waited for before evicting further. The status goes to errcode, or exits if errcode is NULL.
+cl_mem create_buffer_spilling(cl_mem_flags flags, size_t bytes, void *host_ptr, cl_int *errcode) {
+    while (device_alloc_stats.current + bytes > get_device_budget() && evict_vector()) {
+    }
+    bool drained = false;
+    while (true) {
+        cl_int status;
+        cl_mem mem = tracked_clCreateBuffer(context, flags, bytes, host_ptr, &status);
+        bool out_of_memory = status == CL_MEM_OBJECT_ALLOCATION_FAILURE || status == CL_OUT_OF_RESOURCES;
+        if (out_of_memory && !drained) {
+            reclaim_drain();
+            drained = true;
+        } else if (status == CL_SUCCESS || !out_of_memory || !evict_vector()) {
+            if (errcode != NULL) {
+                *errcode = status;
+            } else {
+                check_error(status, "Couldn't create a device buffer");
+            }
+            return mem;
+        }
+    }
+}
+
+// Function definition for making a managed vector resident on the device for the current op. read uploads the
+// host copy when the vector is not resident; write marks the device buffer as newer than the host copy.
+cl_mem acquire_vector(int v, bool read, bool write) {
+    managed_vector &m = managed[v];
+    m.last_used = managed_clock; // Acquired in this op, so making room below never evicts it
+    if (m.mem == NULL) {
+        m.mem = create_buffer_spilling(CL_MEM_READ_WRITE, m.bytes, NULL, NULL);
+        if (read) {
+            check_error(clEnqueueWriteBuffer(queue, m.mem, CL_TRUE, 0, m.bytes, m.host, 0, NULL, NULL),
+                        "Couldn't upload a managed vector");
+            managed_uploads++;
+        }
+    }
+    m.device_dirty = m.device_dirty || write;
+    return m.mem;
+}
+
+// Function definition for bringing the host copy of a managed vector up to date with the device
+void sync_vector(int v) {
+    managed_vector &m = managed[v];
+    if (m.mem != NULL && m.device_dirty) {
+        check_error(clEnqueueReadBuffer(queue, m.mem, CL_TRUE, 0, m.bytes, m.host, 0, NULL, NULL),
+                    "Couldn't read back a managed vector");
+        m.device_dirty = false;
+    }
+}
+
+// Function definition for dropping a vector from the device memory manager, releasing its device buffer
+void unmanage_vector(int v) {
+    if (managed[v].mem != NULL) {
+        deferred_release(managed[v].mem);
+    }
+    managed[v].host = NULL;
+    managed[v].mem = NULL;
+}
+
+// Function definition for querying the resource use of a kernel. __local arguments count only once they are set.
+kernel_resources query_kernel_resources(cl_kernel k) {
+    kernel_resources r = {0, 1, 0, 0, 1, 0};
+    clGetKernelWorkGroupInfo(k, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(r.work_group_size), &r.work_group_size, NULL);
+    clGetKernelWorkGroupInfo(k, device_id, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(r.preferred_multiple),
+                             &r.preferred_multiple, NULL);
+    clGetKernelWorkGroupInfo(k, device_id, CL_KERNEL_PRIVATE_MEM_SIZE, sizeof(r.private_mem), &r.private_mem, NULL);
+    clGetKernelWorkGroupInfo(k, device_id, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(r.local_mem), &r.local_mem, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(r.compute_units), &r.compute_units, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(r.device_local_mem), &r.device_local_mem, NULL);
+    if (r.preferred_multiple == 0) {
+        r.preferred_multiple = 1;
+    }
+    return r;
+}
+
+// Function definition for estimating the fraction of a compute unit's work-item slots a kernel keeps busy at a
+// local size. Work-groups per compute unit are limited by the slots (a partly filled SIMD group takes a whole
+// preferred multiple), by local memory and by private memory; CU_WORK_ITEMS, CU_LOCAL_BYTES and CU_PRIVATE_BYTES
+// are assumptions. CL_DEVICE_LOCAL_MEM_SIZE only bounds a single work-group, so a compute unit is assumed to hold
+// at least that much.
+double estimate_occupancy(const kernel_resources &r, size_t local_size) {
+    if (r.local_mem > r.device_local_mem) {
+        return 0; // The work-group cannot be launched at all
+    }
+    size_t lanes = round_up(local_size, r.preferred_multiple);
+    size_t groups = CU_WORK_ITEMS / lanes;
+    cl_ulong cu_local = r.device_local_mem > CU_LOCAL_BYTES ? r.device_local_mem : CU_LOCAL_BYTES;
+    if (r.local_mem > 0 && cu_local / r.local_mem < groups) {
+        groups = cu_local / r.local_mem;
+    }
+    if (r.private_mem > 0 && CU_PRIVATE_BYTES / (r.private_mem * local_size) < groups) {
+        groups = CU_PRIVATE_BYTES / (r.private_mem * local_size);
+    }
+    return (double)(groups * local_size) / CU_WORK_ITEMS;
+}
+
+// Function definition for checking a local size candidate for a kernel, so a tuner can skip it without timing it.
+// Returns why the candidate is pruned, or NULL if it is worth timing.
+const char *prune_local_size(const kernel_resources &r, size_t local_size) {
+    if (local_size > r.work_group_size) {
+        return "above CL_KERNEL_WORK_GROUP_SIZE";
+    }
+    if (local_size % r.preferred_multiple != 0) {
+        return "not a multiple of the preferred work-group size multiple";
+    }
+    if (estimate_occupancy(r, local_size) < MIN_OCCUPANCY) {
+        return "estimated occupancy below MIN_OCCUPANCY";
+    }
+    return NULL;
+}
+
+// Function definition for timing a kernel whose arguments are set: the fastest of BENCH_REPS runs after a warm-up,
+// from the start and end times of its profiling events
+double profile_kernel_ms(cl_kernel k, size_t global_size, size_t local_size) {
+    cl_int err;
+    if (profiling_queue == NULL) {
+        cl_queue_properties props[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+        profiling_queue = clCreateCommandQueueWithProperties(context, device_id, props, &err);
+        check_error(err, "Couldn't create the profiling queue");
+    }
+
+    double best = -1;
+    for (int rep = 0; rep <= BENCH_REPS; rep++) {
+        cl_event ev;
+        check_error(clEnqueueNDRangeKernel(profiling_queue, k, 1, NULL, &global_size, &local_size, 0, NULL, &ev),
+                    "Couldn't enqueue a profiled kernel");
+        check_error(clWaitForEvents(1, &ev), "Couldn't wait for a profiled kernel");
+        cl_ulong start = 0, end = 0;
+        clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+        clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+        clReleaseEvent(ev);
+        double ms = (end - start) / 1e6;
+        if (rep > 0 && (best < 0 || ms < best)) {
+            best = ms; // Run 0 is the warm-up
+        }
+    }
+    return best;
+}
+
+// Function definition for printing the resource and occupancy report of a kernel at a local size, with its
+// profiled runtime when ms is not negative
+void print_kernel_report(const char *name, cl_kernel k, size_t local_size, double ms) {
+    kernel_resources r = query_kernel_resources(k);
+    printf("occupancy %s local %zu: max work-group %zu, multiple %zu, private %lu B, local %lu B, %u compute units, "
+           "estimated occupancy %.0f%%", name, local_size, r.work_group_size, r.preferred_multiple,
+           (unsigned long)r.private_mem, (unsigned long)r.local_mem, r.compute_units, 100 * estimate_occupancy(r, local_size));
+    if (ms >= 0) {
+        printf(", %f ms", ms);
+    }
+    printf("\n");
+}
@@ -1,26 +1,76 @@
 #include <iostream>
 #include <vector>
+#if __cplusplus >= 202002L
+#include <version> // Include version for the span and mdspan feature-test macros
+#endif
+#ifdef __cpp_lib_span
+#include <span>    // Include span for the non-owning 1D overload
+#endif
+#ifdef __cpp_lib_mdspan
+#include <mdspan>  // Include mdspan for the non-owning 2D overload
+#include <type_traits> // Include type_traits for checking the mdspan element types
+#endif
 #include <CL/cl.h>
+#include "alloc_tracker.h"
 
 using namespace std;
 
-void addVectors_OpenCL(vector<int>& a, vector<int>& b, vector<int>& c, int n) {
+#define REGISTRY_SIZE 16 // Host vectors whose device buffers are kept between calls
+
+// A host vector registered with a persistent device buffer. The key is (address, bytes, generation): the caller
+// bumps the generation with invalidateVector_OpenCL() after changing the contents.
+struct host_registration {
+    const void *address;          // Start of the caller's memory, NULL if the slot is free
+    size_t bytes;                 // Size of the caller's memory
+    unsigned long generation;     // Generation of the contents the caller has now
+    unsigned long uploaded;       // Generation of the contents the device buffer holds
+    unsigned long last_used;      // Call counter value at the last lookup, for least-recently-used eviction
+    cl_mem buffer;                // Device buffer, created with CL_MEM_USE_HOST_PTR on unified-memory devices
+};
+
+// OpenCL objects created on the first call and kept until releaseOpenCL()
+cl_device_id ocl_device = NULL;
+cl_context ocl_context = NULL;
+cl_command_queue ocl_queue = NULL;
+cl_program ocl_program = NULL;
+cl_kernel ocl_kernel = NULL;
+cl_kernel ocl_strided_kernel = NULL;
+bool ocl_unified = false; // Whether the device shares physical memory with the host
+
+host_registration registry[REGISTRY_SIZE]; // Registered host vectors
+unsigned long registry_clock = 0;          // Lookups made so far
+unsigned long registry_uploads = 0;        // Uploads made so far, for reporting
+
+// Function definition for exiting on an OpenCL error
+void checkError_OpenCL(cl_int err, const char *message) {
+    if (err != CL_SUCCESS) {
+        cerr << message << " (error " << err << ")" << endl;
+        exit(1);
+    }
+}
+
+// Function definition for creating the OpenCL device, context, queue and kernel on first use
+void setupOpenCL() {
+    if (ocl_context != NULL) {
+        return;
+    }
+    cl_int err;
+
     // Get available platforms
     cl_platform_id platform;
-    clGetPlatformIDs(1, &platform, NULL);
+    checkError_OpenCL(clGetPlatformIDs(1, &platform, NULL), "Couldn't find an OpenCL platform");
 
     // Get available devices
-    cl_device_id device;
-    clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
+    checkError_OpenCL(clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &ocl_device, NULL), "Couldn't find a GPU device");
+    cl_bool unified = CL_FALSE;
+    clGetDeviceInfo(ocl_device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, NULL);
+    ocl_unified = unified == CL_TRUE;
 
     // Create a context and command queue for the device
-    cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, NULL);
-    cl_command_queue queue = clCreateCommandQueue(context, device, 0, NULL);
-
-    // Create buffers for the input and output vectors
-    cl_mem bufferA = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int) * n, a.data(), NULL);
-    cl_mem bufferB = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int) * n, b.data(), NULL);
-    cl_mem bufferC = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(int) * n, NULL, NULL);
+    ocl_context = clCreateContext(NULL, 1, &ocl_device, NULL, NULL, &err);
+    checkError_OpenCL(err, "Couldn't create a context");
+    ocl_queue = clCreateCommandQueue(ocl_context, ocl_device, 0, &err);
+    checkError_OpenCL(err, "Couldn't create a command queue");
 
     // Create a program from the kernel source code
     const char* kernelSourceCode =
@@ -29,39 +79,242 @@ void addVectors_OpenCL(vector<int>& a, vector<int>& b, vector<int>& c, int n) {
         "   if (i < n) {\n"
         "       c[i] = a[i] + b[i];\n"
         "   }\n"
+        "}\n"
+        "__kernel void vector_add_strided_ocl(__global const int* a, __global const int* b, __global int* c, int rows, int cols,\n"
+        "                                     long a_row, long a_col, long b_row, long b_col, long c_row, long c_col) {\n"
+        "   int col = get_global_id(0);\n"
+        "   int row = get_global_id(1);\n"
+        "   if (row < rows && col < cols) {\n"
+        "       c[row * c_row + col * c_col] = a[row * a_row + col * a_col] + b[row * b_row + col * b_col];\n"
+        "   }\n"
         "}\n";
-    cl_program program = clCreateProgramWithSource(context, 1, &kernelSourceCode, NULL, NULL);
+    ocl_program = clCreateProgramWithSource(ocl_context, 1, &kernelSourceCode, NULL, &err);
+    checkError_OpenCL(err, "Couldn't create the program");
 
     // Build the program
-    clBuildProgram(program, 1, &device, NULL, NULL, NULL);
+    checkError_OpenCL(clBuildProgram(ocl_program, 1, &ocl_device, NULL, NULL, NULL), "Couldn't build the program");
 
     // Create a kernel object from the program
-    cl_kernel kernel = clCreateKernel(program, "vector_add_ocl", NULL);
-
-    // Set the kernel arguments
-    clSetKernelArg(kernel, 0, sizeof(cl_mem), &bufferA);
-    clSetKernelArg(kernel, 1, sizeof(cl_mem), &bufferB);
-    clSetKernelArg(kernel, 2, sizeof(cl_mem), &bufferC);
-    clSetKernelArg(kernel, 3, sizeof(int), &n);
-
-    // Execute the kernel on the device
-    size_t globalSize = n;
-    clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &globalSize, NULL, 0, NULL, NULL);
-
-    // Read the result back into the output vector
-    clEnqueueReadBuffer(queue, bufferC, CL_TRUE, 0, sizeof(int) * n, c.data(), 0, NULL, NULL);
-
-    // Release OpenCL resources
-    clReleaseMemObject(bufferA);
-    clReleaseMemObject(bufferB);
-    clReleaseMemObject(bufferC);
-    clReleaseKernel(kernel);
-    clReleaseProgram(program);
-    clReleaseCommandQueue(queue);
-    clReleaseContext(context);
+    ocl_kernel = clCreateKernel(ocl_program, "vector_add_ocl", &err);
+    checkError_OpenCL(err, "Couldn't create the vector_add_ocl kernel");
+    ocl_strided_kernel = clCreateKernel(ocl_program, "vector_add_strided_ocl", &err);
+    checkError_OpenCL(err, "Couldn't create the vector_add_strided_ocl kernel");
+}
+
+// Function definition for getting the device buffer registered for host memory, uploading the contents only if
+// the buffer is new or the caller has invalidated them since the last upload
+cl_mem registerHostPtr_OpenCL(void *address, size_t bytes, bool upload) {
+    registry_clock++;
+    int slot = -1;
+    for (int i = 0; i < REGISTRY_SIZE; i++) {
+        if (registry[i].address == address && registry[i].bytes == bytes) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot < 0) {
+        // Take a free slot, or evict the least recently used registration
+        slot = 0;
+        for (int i = 0; i < REGISTRY_SIZE; i++) {
+            if (registry[i].address == NULL) {
+                slot = i;
+                break;
+            }
+            if (registry[i].last_used < registry[slot].last_used) {
+                slot = i;
+            }
+        }
+        if (registry[slot].address != NULL) {
+            tracked_clReleaseMemObject(registry[slot].buffer);
+            registry[slot].address = NULL;
+        }
+
+        // On unified memory the buffer aliases the caller's memory, so there is nothing to copy. A failed
+        // creation exits here, so a NULL buffer is never cached.
+        cl_int err;
+        cl_mem_flags flags = CL_MEM_READ_WRITE | (ocl_unified ? CL_MEM_USE_HOST_PTR : 0);
+        registry[slot].buffer = tracked_clCreateBuffer(ocl_context, flags, bytes, ocl_unified ? address : NULL, &err);
+        checkError_OpenCL(err, "Couldn't create a buffer for host memory");
+        registry[slot].address = address;
+        registry[slot].bytes = bytes;
+        registry[slot].generation = 1;
+        registry[slot].uploaded = ocl_unified ? 1 : 0;
+    }
+    registry[slot].last_used = registry_clock;
+
+    if (upload && registry[slot].uploaded != registry[slot].generation) {
+        // With USE_HOST_PTR this write is from the buffer's own host memory, which just resynchronises it
+        checkError_OpenCL(clEnqueueWriteBuffer(ocl_queue, registry[slot].buffer, CL_FALSE, 0, bytes, address, 0, NULL, NULL),
+                          "Couldn't upload host memory");
+        registry[slot].uploaded = registry[slot].generation;
+        registry_uploads++;
+    }
+    return registry[slot].buffer;
+}
+
+// Function definition for invalidating every registration that starts at or overlaps [address, address + bytes),
+// except the one holding the buffer except
+void invalidateOverlapping(const void *address, size_t bytes, cl_mem except) {
+    const char *begin = (const char *)address;
+    for (int i = 0; i < REGISTRY_SIZE; i++) {
+        const char *start = (const char *)registry[i].address;
+        if (start == NULL || registry[i].buffer == except) {
+            continue;
+        }
+        if (start == begin || (start < begin + bytes && begin < start + registry[i].bytes)) {
+            registry[i].generation++;
+        }
+    }
+}
+
+// Function definition for telling the registration cache that caller memory has changed: any span, strided view,
+// array or mmapped region passed to the overloads below. Every registration overlapping the range is invalidated.
+void invalidate_OpenCL(const void *address, size_t bytes) {
+    invalidateOverlapping(address, bytes, NULL);
+}
+
+// Function definition for telling the registration cache that a vector's contents have changed. Every
+// registration at the vector's address is invalidated, whatever length it was registered with.
+void invalidateVector_OpenCL(const vector<int>& v) {
+    invalidate_OpenCL(v.data(), sizeof(int) * v.size());
+}
+
+// Function definition for the bytes a rows x cols view with the given element strides spans
+size_t viewBytes(const long *strides, size_t rows, size_t cols) {
+    return ((rows - 1) * strides[0] + (cols - 1) * strides[1] + 1) * sizeof(int);
+}
+
+// Function definition for whether a view is one dense run of rows * cols elements
+bool isContiguous(const long *strides, size_t rows, size_t cols) {
+    return strides[1] == 1 && (rows == 1 || strides[0] == (long)cols);
+}
+
+// Function definition for c = a + b over rows x cols views of caller memory. Element (r, k) of a view is at
+// data[r * strides[0] + k * strides[1]]; the memory each view spans is registered as it is, so no host copies are
+// made and dense views use the plain kernel while strided ones pass their strides to the strided kernel.
+void addStrided_OpenCL(const int *a, const long *a_strides, const int *b, const long *b_strides,
+                       int *c, const long *c_strides, size_t rows, size_t cols) {
+    if (rows == 0 || cols == 0) {
+        return;
+    }
+    setupOpenCL();
+
+    // Look up the persistent buffers for the input and output views, uploading only inputs invalidated since
+    // their last upload. A strided output is uploaded on every call, so reading its whole span back keeps the
+    // caller's current values between the elements.
+    bool c_dense = isContiguous(c_strides, rows, cols);
+    size_t c_bytes = viewBytes(c_strides, rows, cols);
+    cl_mem bufferA = registerHostPtr_OpenCL((void *)a, viewBytes(a_strides, rows, cols), true);
+    cl_mem bufferB = registerHostPtr_OpenCL((void *)b, viewBytes(b_strides, rows, cols), true);
+    if (!c_dense) {
+        invalidate_OpenCL(c, c_bytes);
+    }
+    cl_mem bufferC = registerHostPtr_OpenCL(c, c_bytes, !c_dense);
+
+    if (c_dense && isContiguous(a_strides, rows, cols) && isContiguous(b_strides, rows, cols)) {
+        // Set the kernel arguments
+        int n = (int)(rows * cols);
+        checkError_OpenCL(clSetKernelArg(ocl_kernel, 0, sizeof(cl_mem), &bufferA) |
+                          clSetKernelArg(ocl_kernel, 1, sizeof(cl_mem), &bufferB) |
+                          clSetKernelArg(ocl_kernel, 2, sizeof(cl_mem), &bufferC) |
+                          clSetKernelArg(ocl_kernel, 3, sizeof(int), &n), "Couldn't set the kernel arguments");
+
+        // Execute the kernel on the device
+        size_t globalSize = n;
+        checkError_OpenCL(clEnqueueNDRangeKernel(ocl_queue, ocl_kernel, 1, NULL, &globalSize, NULL, 0, NULL, NULL),
+                          "Couldn't enqueue the kernel");
+    } else {
+        int num_rows = (int)rows, num_cols = (int)cols;
+        cl_long strides[6] = {a_strides[0], a_strides[1], b_strides[0], b_strides[1], c_strides[0], c_strides[1]};
+        cl_int err = clSetKernelArg(ocl_strided_kernel, 0, sizeof(cl_mem), &bufferA) |
+                     clSetKernelArg(ocl_strided_kernel, 1, sizeof(cl_mem), &bufferB) |
+                     clSetKernelArg(ocl_strided_kernel, 2, sizeof(cl_mem), &bufferC) |
+                     clSetKernelArg(ocl_strided_kernel, 3, sizeof(int), &num_rows) |
+                     clSetKernelArg(ocl_strided_kernel, 4, sizeof(int), &num_cols);
+        for (int i = 0; i < 6; i++) {
+            err |= clSetKernelArg(ocl_strided_kernel, 5 + i, sizeof(cl_long), &strides[i]);
+        }
+        checkError_OpenCL(err, "Couldn't set the strided kernel arguments");
+        size_t globalSize[2] = {cols, rows};
+        checkError_OpenCL(clEnqueueNDRangeKernel(ocl_queue, ocl_strided_kernel, 2, NULL, globalSize, NULL, 0, NULL, NULL),
+                          "Couldn't enqueue the strided kernel");
+    }
+
+    // Make the result visible in the output memory: map and unmap a host-pointer buffer, otherwise read it back
+    if (ocl_unified) {
+        cl_int err;
+        void *mapped = clEnqueueMapBuffer(ocl_queue, bufferC, CL_TRUE, CL_MAP_READ, 0, c_bytes, 0, NULL, NULL, &err);
+        checkError_OpenCL(err, "Couldn't map the result");
+        checkError_OpenCL(clEnqueueUnmapMemObject(ocl_queue, bufferC, mapped, 0, NULL, NULL), "Couldn't unmap the result");
+        checkError_OpenCL(clFinish(ocl_queue), "Couldn't finish the queue");
+    } else {
+        checkError_OpenCL(clEnqueueReadBuffer(ocl_queue, bufferC, CL_TRUE, 0, c_bytes, c, 0, NULL, NULL),
+                          "Couldn't read the result");
+    }
+
+    // Other registrations over the output memory, e.g. an input view of it, now hold old contents
+    invalidateOverlapping(c, c_bytes, bufferC);
+}
+
+void addVectors_OpenCL(vector<int>& a, vector<int>& b, vector<int>& c, int n) {
+    const long dense[2] = {n, 1};
+    addStrided_OpenCL(a.data(), dense, b.data(), dense, c.data(), dense, 1, n);
+}
+
+#ifdef __cpp_lib_span
+// Function definition for c = a + b over any contiguous caller memory, e.g. a std::vector, an array or an mmapped file.
+// Call invalidate_OpenCL() on an input after changing it, as its device copy is kept between calls.
+void addVectors_OpenCL(span<const int> a, span<const int> b, span<int> c) {
+    if (a.size() != c.size() || b.size() != c.size()) {
+        cerr << "addVectors_OpenCL: spans differ in size" << endl;
+        exit(1);
+    }
+    const long dense[2] = {(long)c.size(), 1};
+    addStrided_OpenCL(a.data(), dense, b.data(), dense, c.data(), dense, 1, c.size());
+}
+#endif
+
+#ifdef __cpp_lib_mdspan
+// Function definition for c = a + b over 2D caller memory with any extents type and strided layout (layout_right,
+// layout_left, layout_stride); the mdspan strides are passed to the kernel as they are. Inputs may be int or const int.
+// Call invalidate_OpenCL() on an input after changing it, as its device copy is kept between calls.
+template <class TA, class EA, class LA, class TB, class EB, class LB, class EC, class LC>
+void addVectors_OpenCL(mdspan<TA, EA, LA> a, mdspan<TB, EB, LB> b, mdspan<int, EC, LC> c) {
+    static_assert(is_same_v<remove_const_t<TA>, int> && is_same_v<remove_const_t<TB>, int>, "inputs must hold int");
+    static_assert(EA::rank() == 2 && EB::rank() == 2 && EC::rank() == 2, "views must be 2D");
+    if (a.extent(0) != c.extent(0) || a.extent(1) != c.extent(1) || b.extent(0) != c.extent(0) || b.extent(1) != c.extent(1)) {
+        cerr << "addVectors_OpenCL: mdspans differ in shape" << endl;
+        exit(1);
+    }
+    const long a_strides[2] = {(long)a.stride(0), (long)a.stride(1)};
+    const long b_strides[2] = {(long)b.stride(0), (long)b.stride(1)};
+    const long c_strides[2] = {(long)c.stride(0), (long)c.stride(1)};
+    addStrided_OpenCL(a.data_handle(), a_strides, b.data_handle(), b_strides, c.data_handle(), c_strides, c.extent(0), c.extent(1));
+}
+#endif
+
+// Function definition for releasing the registered buffers and the OpenCL objects
+void releaseOpenCL() {
+    for (int i = 0; i < REGISTRY_SIZE; i++) {
+        if (registry[i].address != NULL) {
+            tracked_clReleaseMemObject(registry[i].buffer);
+            registry[i].address = NULL;
+        }
+    }
+    if (ocl_context != NULL) {
+        clReleaseKernel(ocl_kernel);
+        clReleaseKernel(ocl_strided_kernel);
+        clReleaseProgram(ocl_program);
+        clReleaseCommandQueue(ocl_queue);
+        clReleaseContext(ocl_context);
+        ocl_context = NULL;
+    }
 }
 
 int main() {
+    atexit(print_alloc_summary); // Report device memory use when the program exits
+
     int n = 5; // Vector size
 
     // Create input vectors
@@ -69,8 +322,54 @@ int main() {
     vector<int> b = {6, 7, 8, 9, 10};
     vector<int> c(n);
 
-    // Perform vector addition using OpenCL
+    // Perform vector addition using OpenCL, twice on the same vectors: the second call reuses the buffers
     addVectors_OpenCL(a, b, c, n);
+    addVectors_OpenCL(a, b, c, n);
+    cout << "Uploads after two calls on unchanged vectors: " << registry_uploads << endl;
+
+    // Change an input and tell the cache, so only that vector is uploaded again
+    a[0] = 100;
+    invalidateVector_OpenCL(a);
+    addVectors_OpenCL(a, b, c, n);
+    cout << "Uploads after changing one input: " << registry_uploads << endl;
+
+    // Add the columns of a 5 x 2 row-major matrix into every other element of an output buffer, with no copies
+    int matrix[10] = {1, 10, 2, 20, 3, 30, 4, 40, 5, 50};
+    int interleaved[10] = {0};
+    const long column_view[2] = {0, 2};
+    addStrided_OpenCL(matrix, column_view, matrix + 1, column_view, interleaved, column_view, 1, n);
+    cout << "Strided column sums:";
+    for (int i = 0; i < n; ++i) {
+        cout << " " << interleaved[2 * i];
+    }
+    cout << endl;
+
+#ifdef __cpp_lib_span
+    // The same add over spans of plain arrays; after changing an input the caller invalidates its memory range
+    int span_a[5] = {1, 2, 3, 4, 5}, span_b[5] = {6, 7, 8, 9, 10}, span_c[5];
+    addVectors_OpenCL(span_a, span_b, span_c);
+    span_a[4] = 50;
+    invalidate_OpenCL(span_a, sizeof(span_a));
+    addVectors_OpenCL(span_a, span_b, span_c);
+    cout << "Span sums:";
+    for (int i = 0; i < n; ++i) {
+        cout << " " << span_c[i];
+    }
+    cout << endl;
+#endif
+
+#ifdef __cpp_lib_mdspan
+    // The 5 x 2 row-major matrix plus itself, written into a column-major 5 x 2 result
+    int column_major[10];
+    mdspan<const int, dextents<size_t, 2>> rows_view(matrix, 5, 2);
+    mdspan<int, dextents<size_t, 2>, layout_left> result_view(column_major, 5, 2);
+    addVectors_OpenCL(rows_view, rows_view, result_view);
+    cout << "Column-major doubled matrix:";
+    for (int i = 0; i < 10; ++i) {
+        cout << " " << column_major[i];
+    }
+    cout << endl;
+#endif
 
     // Print the result
     cout << "Result of vector addition:" << endl;
@@ -79,5 +378,6 @@ int main() {
     }
     cout << endl;
 
+    releaseOpenCL();
     return 0;
 }
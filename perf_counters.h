@@ -0,0 +1,108 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifndef PERF_COUNTERS
+#define PERF_COUNTERS 1 // Macro for hardware counter control
+#endif
+
+#if PERF_COUNTERS && defined(__linux__)
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#define PERF_AVAILABLE 1
+#else
+#define PERF_AVAILABLE 0
+#endif
+
+#define PERF_NUM_COUNTERS 4 // cycles, instructions, LLC misses, dTLB misses
+
+static int perf_state = 0; // 0 = not opened yet, 1 = open, -1 = not permitted or not supported
+
+#if PERF_AVAILABLE
+static const char *perf_counter_names[PERF_NUM_COUNTERS] = {"cycles", "instructions", "LLC-misses", "dTLB-misses"};
+static int perf_fds[PERF_NUM_COUNTERS] = {-1, -1, -1, -1}; // File descriptors, -1 when a counter is unavailable
+
+// Function definition for opening one counter in the group led by group_fd
+static inline int perf_open(uint32_t type, uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group_fd == -1;   // Only the leader starts disabled, members follow it
+    attr.exclude_kernel = 1;          // User space only, so perf_event_paranoid 2 still works
+    attr.exclude_hv = 1;
+    attr.inherit = 1;                 // Threads started after opening count too, folded in when they exit
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+// Function definition for opening the hardware counters, once
+static inline void perf_init() {
+    if (perf_state != 0) {
+        return;
+    }
+#if PERF_AVAILABLE
+    perf_fds[0] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (perf_fds[0] < 0) {
+        printf("Hardware counters unavailable (%s), reporting timings only\n", strerror(errno));
+        perf_state = -1;
+        return;
+    }
+    perf_fds[1] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, perf_fds[0]);
+    perf_fds[2] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, perf_fds[0]);
+    perf_fds[3] = perf_open(PERF_TYPE_HW_CACHE,
+                            PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                            perf_fds[0]);
+    perf_state = 1;
+#else
+    perf_state = -1;
+#endif
+}
+
+// Function definition for starting the counters before a host phase
+static inline void perf_begin() {
+    perf_init();
+#if PERF_AVAILABLE
+    if (perf_state == 1) {
+        ioctl(perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+// Function definition for stopping the counters and printing them next to the phase timing. Worker threads of the
+// phase must have been joined. Each counter is read on its own: inherited counters cannot be read as a group.
+static inline void perf_end(const char *phase) {
+#if PERF_AVAILABLE
+    if (perf_state != 1) {
+        return;
+    }
+    ioctl(perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    uint64_t values[PERF_NUM_COUNTERS] = {0, 0, 0, 0};
+    printf("  %s counters:", phase);
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (perf_fds[i] < 0 || read(perf_fds[i], &values[i], sizeof(uint64_t)) != sizeof(uint64_t)) {
+            printf(" %s=n/a", perf_counter_names[i]); // Counter not supported on this CPU
+            continue;
+        }
+        printf(" %s=%llu", perf_counter_names[i], (unsigned long long)values[i]);
+    }
+    if (values[0] > 0 && perf_fds[1] >= 0) {
+        printf(" IPC=%.2f", (double)values[1] / values[0]);
+    }
+    printf("\n");
+#else
+    (void)phase;
+#endif
+}
+
+#endif
@@ -0,0 +1,57 @@
+// OpenCL kernel for 1D stencils (moving sums, FIR filters), built once per radius, coefficient set and vector width.
+// The host defines:
+//   STENCIL_RADIUS      window half-width, the window has 2 * STENCIL_RADIUS + 1 taps
+//   STENCIL_COEFFS      comma-separated float literals, one per tap, first tap at offset -STENCIL_RADIUS
+//   STENCIL_WIDTH       outputs per work-item: 1, 2, 4, 8 or 16
+//   STENCIL_LOCAL_SIZE  work-group size
+
+#define STENCIL_TAPS (2 * STENCIL_RADIUS + 1)
+#define STENCIL_TILE (STENCIL_LOCAL_SIZE * STENCIL_WIDTH) // Outputs per work-group
+
+#define CAT_(a, b) a##b
+#define CAT(a, b) CAT_(a, b)
+#if STENCIL_WIDTH == 1
+#define VEC_T float
+#define VLOAD(p) (*(p))
+#define VSTORE(v, p) (*(p) = (v))
+#else
+#define VEC_T CAT(float, STENCIL_WIDTH)
+#define VLOAD(p) CAT(vload, STENCIL_WIDTH)(0, (p))
+#define VSTORE(v, p) CAT(vstore, STENCIL_WIDTH)((v), 0, (p))
+#endif
+
+__constant float stencil_coeffs[STENCIL_TAPS] = {STENCIL_COEFFS};
+
+// Kernel for out[i] = sum_j coeffs[j] * in[i + j - STENCIL_RADIUS], with zeros outside the signal.
+// Each work-group loads its tile plus a halo of STENCIL_RADIUS on each side into local memory once, then every
+// work-item computes STENCIL_WIDTH consecutive outputs as one vector from the tile.
+__kernel __attribute__((reqd_work_group_size(STENCIL_LOCAL_SIZE, 1, 1)))
+void stencil_ocl(const int size, __global const float *in, __global float *out) {
+    __local float tile[STENCIL_TILE + 2 * STENCIL_RADIUS];
+    const int lid = get_local_id(0);
+    const int tile_start = get_group_id(0) * STENCIL_TILE;
+
+    for (int i = lid; i < STENCIL_TILE + 2 * STENCIL_RADIUS; i += STENCIL_LOCAL_SIZE) {
+        const int g = tile_start - STENCIL_RADIUS + i;
+        tile[i] = g >= 0 && g < size ? in[g] : 0.0f;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    const int first = lid * STENCIL_WIDTH;
+    VEC_T acc = 0.0f;
+#pragma unroll
+    for (int j = 0; j < STENCIL_TAPS; j++) {
+        acc += stencil_coeffs[j] * VLOAD(&tile[first + j]); // Window of output first + k starts at tile[first + k]
+    }
+
+    const int o = tile_start + first;
+    if (o + STENCIL_WIDTH <= size) {
+        VSTORE(acc, &out[o]);
+    } else if (o < size) {
+        float parts[STENCIL_WIDTH];
+        VSTORE(acc, parts);
+        for (int k = 0; o + k < size; k++) {
+            out[o + k] = parts[k];
+        }
+    }
+}
@@ -0,0 +1,605 @@
+// OpenCL kernels for vector operations
+
+// Use the compiler's non-temporal store where available, otherwise a plain vector store
+#if defined(__clang__) && defined(__has_builtin)
+#if __has_builtin(__builtin_nontemporal_store)
+#define STORE4_NT(value, ptr) __builtin_nontemporal_store((value), (__global int4 *)(ptr))
+#endif
+#endif
+#ifndef STORE4_NT
+#define STORE4_NT(value, ptr) vstore4((value), 0, (ptr))
+#endif
+
+// Kernel for adding vectors: v_out[i] = v1[i] + v2[i]
+__kernel void vector_add_ocl(const int size, __global int *v1, __global int *v2, __global int *v_out) {
+    const int globalIndex = get_global_id(0); // Index of the element handled by this work-item
+    if (globalIndex < size) {
+        v_out[globalIndex] = v1[globalIndex] + v2[globalIndex];
+    }
+}
+
+// Kernel for adding vectors with write-once outputs, 4 elements per work-item
+__kernel void vector_add_nt_ocl(const int size, __global int *v1, __global int *v2, __global int *v_out) {
+    const int base = get_global_id(0) * 4; // First element handled by this work-item
+
+    if (base + 4 <= size) {
+        int4 sum = vload4(0, v1 + base) + vload4(0, v2 + base);
+        STORE4_NT(sum, v_out + base); // v_out is not read again, so keep it out of the cache
+    } else {
+        for (int i = base; i < size; i++) {
+            v_out[i] = v1[i] + v2[i]; // Tail elements when size is not a multiple of 4
+        }
+    }
+}
+
+// Kernel for gathering: out[i] = src[idx[i]]
+__kernel void gather_ocl(const int size, __global const int *idx, __global const int *src, __global int *out) {
+    const int i = get_global_id(0);
+    if (i < size) {
+        out[i] = src[idx[i]];
+    }
+}
+
+// Kernel for scattering: out[idx[i]] = values[i], colliding indices keep an arbitrary one of their values
+__kernel void scatter_ocl(const int size, __global const int *idx, __global const int *values, __global int *out) {
+    const int i = get_global_id(0);
+    if (i < size) {
+        out[idx[i]] = values[i];
+    }
+}
+
+// Kernel for scatter-add with a private copy of out per work-group in local memory
+__kernel void scatter_add_local_ocl(const int size, __global const int *idx, __global const int *values,
+                                    __global int *out, const int out_size, __local int *priv) {
+    for (int b = get_local_id(0); b < out_size; b += get_local_size(0)) {
+        priv[b] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Colliding indices only contend within the work-group, on fast local atomics
+    for (int i = get_global_id(0); i < size; i += get_global_size(0)) {
+        atomic_add(&priv[idx[i]], values[i]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // One global atomic per touched bin and work-group
+    for (int b = get_local_id(0); b < out_size; b += get_local_size(0)) {
+        if (priv[b] != 0) {
+            atomic_add(&out[b], priv[b]);
+        }
+    }
+}
+
+// Kernel for scatter-add with global atomics, for outputs too large for local memory
+__kernel void scatter_add_global_ocl(const int size, __global const int *idx, __global const int *values, __global int *out) {
+    const int i = get_global_id(0);
+    if (i < size) {
+        atomic_add(&out[idx[i]], values[i]);
+    }
+}
+
+// Kernel for adding runs of equal sorted keys into out, one atomic per run and chunk of SEG_CHUNK elements.
+// SEG_CHUNK is passed by the host as a build option, so both sides size the chunks the same way.
+__kernel void segmented_reduce_ocl(const int size, __global const int *keys, __global const int *values, __global int *out) {
+    const int start = get_global_id(0) * SEG_CHUNK;
+    const int end = min(start + SEG_CHUNK, size);
+    if (start >= end) {
+        return;
+    }
+
+    int key = keys[start];
+    int sum = 0;
+    for (int i = start; i < end; i++) {
+        if (keys[i] != key) {
+            atomic_add(&out[key], sum); // Run ended inside the chunk
+            key = keys[i];
+            sum = 0;
+        }
+        sum += values[i];
+    }
+    atomic_add(&out[key], sum); // A run may continue in the next chunk, so this one is atomic too
+}
+
+// Kernel for histogramming with a private histogram per work-group in local memory
+__kernel void histogram_local_ocl(const int size, __global const int *data, __global int *hist,
+                                  const int num_bins, const int min_value, __local int *priv) {
+    for (int b = get_local_id(0); b < num_bins; b += get_local_size(0)) {
+        priv[b] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = get_global_id(0); i < size; i += get_global_size(0)) {
+        const int bin = data[i] - min_value;
+        if (bin >= 0 && bin < num_bins) {
+            atomic_inc(&priv[bin]); // Values outside the bin range are ignored
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int b = get_local_id(0); b < num_bins; b += get_local_size(0)) {
+        if (priv[b] != 0) {
+            atomic_add(&hist[b], priv[b]);
+        }
+    }
+}
+
+// Kernel for histogramming straight into global memory, for bin counts too large for local memory
+__kernel void histogram_global_ocl(const int size, __global const int *data, __global int *hist,
+                                   const int num_bins, const int min_value) {
+    const int i = get_global_id(0);
+    if (i < size) {
+        const int bin = data[i] - min_value;
+        if (bin >= 0 && bin < num_bins) {
+            atomic_inc(&hist[bin]);
+        }
+    }
+}
+
+// Kernel for an exclusive scan of one block in local memory, writing each block's total to block_sums
+__kernel void scan_block_ocl(const int size, __global int *data, __global int *block_sums, __local int *tmp) {
+    const int lid = get_local_id(0);
+    const int gid = get_global_id(0);
+    const int local_size = get_local_size(0);
+    const int value = gid < size ? data[gid] : 0;
+
+    tmp[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int offset = 1; offset < local_size; offset *= 2) {
+        const int add = lid >= offset ? tmp[lid - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        tmp[lid] += add;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (gid < size) {
+        data[gid] = tmp[lid] - value; // Inclusive to exclusive
+    }
+    if (lid == local_size - 1) {
+        block_sums[get_group_id(0)] = tmp[lid];
+    }
+}
+
+// Kernel for adding the scanned block totals back into each block
+__kernel void scan_add_ocl(const int size, __global int *data, __global const int *block_offsets) {
+    const int gid = get_global_id(0);
+    if (gid < size) {
+        data[gid] += block_offsets[get_group_id(0)];
+    }
+}
+
+#define RADIX_BITS 4                     // Key bits sorted per pass
+#define RADIX_BUCKETS (1 << RADIX_BITS)  // Digit values per pass
+#define RADIX_ITEMS 256                  // Keys counted and scattered by each work-item
+
+// Radix sort kernels for one signed key type. Each work-item owns RADIX_ITEMS consecutive keys, and
+// counts are stored digit-major (counts[digit * num_items + item]), so an exclusive scan over counts
+// gives every work-item a stable output position for each digit.
+#define RADIX_KERNELS(SUFFIX, KEY_T, UKEY_T)                                                                   \
+__kernel void radix_count_##SUFFIX(const int size, __global const KEY_T *keys, __global int *counts,          \
+                                   const int shift, const int num_items) {                                   \
+    const int item = get_global_id(0);                                                                       \
+    if (item >= num_items) {                                                                                 \
+        return;                                                                                              \
+    }                                                                                                        \
+    int digit_counts[RADIX_BUCKETS];                                                                         \
+    for (int d = 0; d < RADIX_BUCKETS; d++) {                                                                \
+        digit_counts[d] = 0;                                                                                 \
+    }                                                                                                        \
+    const int end = min((item + 1) * RADIX_ITEMS, size);                                                     \
+    for (int i = item * RADIX_ITEMS; i < end; i++) {                                                         \
+        digit_counts[RADIX_DIGIT(UKEY_T, keys[i], shift)]++;                                                 \
+    }                                                                                                        \
+    for (int d = 0; d < RADIX_BUCKETS; d++) {                                                                \
+        counts[d * num_items + item] = digit_counts[d];                                                      \
+    }                                                                                                        \
+}                                                                                                            \
+                                                                                                             \
+__kernel void radix_scatter_##SUFFIX(const int size, __global const KEY_T *keys_in, __global KEY_T *keys_out, \
+                                     __global const int *values_in, __global int *values_out,                 \
+                                     __global const int *offsets, const int shift, const int num_items) {     \
+    const int item = get_global_id(0);                                                                       \
+    if (item >= num_items) {                                                                                 \
+        return;                                                                                              \
+    }                                                                                                        \
+    int digit_offsets[RADIX_BUCKETS];                                                                        \
+    for (int d = 0; d < RADIX_BUCKETS; d++) {                                                                \
+        digit_offsets[d] = offsets[d * num_items + item];                                                    \
+    }                                                                                                        \
+    const int end = min((item + 1) * RADIX_ITEMS, size);                                                     \
+    for (int i = item * RADIX_ITEMS; i < end; i++) {                                                         \
+        const KEY_T key = keys_in[i];                                                                        \
+        const int pos = digit_offsets[RADIX_DIGIT(UKEY_T, key, shift)]++;                                    \
+        keys_out[pos] = key;                                                                                 \
+        if (values_in != 0) {                                                                                \
+            values_out[pos] = values_in[i];                                                                  \
+        }                                                                                                    \
+    }                                                                                                        \
+}
+
+// Digit of a signed key with the sign bit flipped, so negative keys sort before positive ones
+#define RADIX_DIGIT(UKEY_T, key, shift) \
+    (int)(((((UKEY_T)(key)) ^ ((UKEY_T)1 << (sizeof(UKEY_T) * 8 - 1))) >> (shift)) & (RADIX_BUCKETS - 1))
+
+RADIX_KERNELS(int, int, uint)
+RADIX_KERNELS(long, long, ulong)
+
+// Kernel for keeping the k largest values of each tile of 2 * local size elements, sorted descending
+__kernel void topk_local_ocl(const int size, __global const int *data, const int k,
+                             __global int *candidates, __local int *tile) {
+    const int lid = get_local_id(0);
+    const int local_size = get_local_size(0);
+    const int tile_size = 2 * local_size;
+    const int base = get_group_id(0) * tile_size;
+
+    // Missing elements are padded with the smallest int so they never make the top k
+    tile[lid] = base + lid < size ? data[base + lid] : INT_MIN;
+    tile[lid + local_size] = base + lid + local_size < size ? data[base + lid + local_size] : INT_MIN;
+
+    // Bitonic sort of the tile, each work-item owning one compare-exchange pair per step
+    for (int span = 2; span <= tile_size; span <<= 1) {
+        for (int stride = span >> 1; stride > 0; stride >>= 1) {
+            barrier(CLK_LOCAL_MEM_FENCE);
+            const int pos = 2 * lid - (lid & (stride - 1));
+            const bool descending = (pos & span) == 0;
+            const int a = tile[pos];
+            const int b = tile[pos + stride];
+            if ((a < b) == descending) {
+                tile[pos] = b;
+                tile[pos + stride] = a;
+            }
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = lid; i < k; i += local_size) {
+        candidates[get_group_id(0) * k + i] = tile[i];
+    }
+}
+
+// Kernel for counting the values above a threshold, one global atomic per work-group
+__kernel void count_above_ocl(const int size, __global const int *data, const int threshold,
+                              __global int *count, __local int *group_count) {
+    if (get_local_id(0) == 0) {
+        *group_count = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int mine = 0;
+    for (int i = get_global_id(0); i < size; i += get_global_size(0)) {
+        mine += data[i] > threshold;
+    }
+    if (mine != 0) {
+        atomic_add(group_count, mine);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (get_local_id(0) == 0 && *group_count != 0) {
+        atomic_add(count, *group_count);
+    }
+}
+
+// Kernel for compacting the values above a threshold into out; order across work-groups is not preserved
+__kernel void select_above_ocl(const int size, __global const int *data, const int threshold,
+                               __global int *out, __global int *count, __local int *group_state) {
+    const int i = get_global_id(0);
+    const bool keep = i < size && data[i] > threshold;
+
+    if (get_local_id(0) == 0) {
+        group_state[0] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Slot within the work-group, then one global atomic reserves the group's range of out
+    const int slot = keep ? atomic_inc(&group_state[0]) : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (get_local_id(0) == 0) {
+        group_state[1] = group_state[0] != 0 ? atomic_add(count, group_state[0]) : 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (keep) {
+        out[group_state[1] + slot] = data[i];
+    }
+}
+
+#define CODEC_CHUNK 1024 // Values per frame-of-reference chunk, matches the host packer
+
+// Decodes value i of a frame-of-reference bit-packed vector. headers holds (base, bits, first word) per chunk.
+inline int unpack_value(__global const int *headers, __global const uint *words, const int i) {
+    const int chunk = i / CODEC_CHUNK;
+    const int base = headers[3 * chunk];
+    const int bits = headers[3 * chunk + 1];
+    if (bits == 0) {
+        return base; // Every value in the chunk equals the base
+    }
+    const uint bit = (uint)(i % CODEC_CHUNK) * bits;
+    const uint word = headers[3 * chunk + 2] + bit / 32;
+    const uint shift = bit % 32;
+    ulong pair = words[word];
+    if (shift + bits > 32) {
+        pair |= (ulong)words[word + 1] << 32; // Value straddles two words
+    }
+    return base + (int)((pair >> shift) & ((1ul << bits) - 1));
+}
+
+// Kernel for adding two bit-packed vectors and packing the sums with one width, out_bits, for the whole vector.
+// Chunk c of the output is relative to headers_a base + headers_b base. Each work-item builds one output word.
+__kernel void decode_add_pack_ocl(const int size, __global const int *headers_a, __global const uint *words_a,
+                                  __global const int *headers_b, __global const uint *words_b,
+                                  const int out_bits, __global uint *out_words, const int num_out_words) {
+    const int w = get_global_id(0);
+    if (w >= num_out_words) {
+        return;
+    }
+    const long first_bit = (long)w * 32;
+    const int first = (int)(first_bit / out_bits);
+    const int last = min((int)((first_bit + 31) / out_bits), size - 1);
+
+    uint packed = 0;
+    for (int v = first; v <= last; v++) {
+        const int chunk = v / CODEC_CHUNK;
+        const int base = headers_a[3 * chunk] + headers_b[3 * chunk];
+        const uint value = (uint)(unpack_value(headers_a, words_a, v) + unpack_value(headers_b, words_b, v) - base);
+        const int pos = (int)((long)v * out_bits - first_bit);
+        packed |= pos >= 0 ? value << pos : value >> -pos; // First value may start in the previous word
+    }
+    out_words[w] = packed;
+}
+
+// Storage types for float data; arithmetic is always done in fp32.
+// f16 uses the core vload_half/vstore_half built-ins, so cl_khr_fp16 is not required.
+// bf16 is stored as ushort: the upper half of an fp32, rounded to nearest even.
+inline float load_bf16(__global const ushort *p, const int i) {
+    return as_float((uint)p[i] << 16);
+}
+
+inline void store_bf16(const float value, __global ushort *p, const int i) {
+    uint bits = as_uint(value);
+    bits = isnan(value) ? (bits | 0x00400000) : bits + 0x7fff + ((bits >> 16) & 1); // Keep NaNs quiet
+    p[i] = (ushort)(bits >> 16);
+}
+
+#define LOAD_f32(p, i) ((p)[i])
+#define STORE_f32(value, p, i) ((p)[i] = (value))
+#define LOAD_f16(p, i) vload_half((i), (p))
+#define STORE_f16(value, p, i) vstore_half_rte((value), (i), (p))
+#define LOAD_bf16(p, i) load_bf16((p), (i))
+#define STORE_bf16(value, p, i) store_bf16((value), (p), (i))
+
+// Float vector and matrix add kernels for one storage type. Matrices are row-major with leading dimension ld;
+// the host passes column-major matrices transposed.
+#define FLOAT_ADD_KERNELS(T, STORAGE_T)                                                                          \
+__kernel void vector_add_##T(const int size, __global const STORAGE_T *a, __global const STORAGE_T *b,         \
+                             __global STORAGE_T *out) {                                                        \
+    const int i = get_global_id(0);                                                                            \
+    if (i < size) {                                                                                            \
+        STORE_##T(LOAD_##T(a, i) + LOAD_##T(b, i), out, i);                                                    \
+    }                                                                                                          \
+}                                                                                                              \
+                                                                                                               \
+__kernel void matrix_add_##T(const int rows, const int cols, const int ld, __global const STORAGE_T *a,         \
+                             __global const STORAGE_T *b, __global STORAGE_T *out) {                           \
+    const int col = get_global_id(0);                                                                          \
+    const int row = get_global_id(1);                                                                          \
+    if (row < rows && col < cols) {                                                                            \
+        const int i = row * ld + col;                                                                          \
+        STORE_##T(LOAD_##T(a, i) + LOAD_##T(b, i), out, i);                                                    \
+    }                                                                                                          \
+}
+
+FLOAT_ADD_KERNELS(f32, float)
+FLOAT_ADD_KERNELS(f16, half)
+FLOAT_ADD_KERNELS(bf16, ushort)
+
+#define GEMM_TILE 16 // Work-group edge and K tile (in packed words) of gemm_int8_ocl
+
+// Dot product of four packed signed 8-bit values, using cl_khr_integer_dot_product when the device has it. The
+// extension can come without the packed-input functions, which have their own feature macro.
+inline int dot_int8x4(const uint a, const uint b) {
+#if defined(cl_khr_integer_dot_product) && defined(__opencl_c_integer_dot_product_input_4x8bit_packed)
+    return dot_4x8packed_ss_int(a, b);
+#else
+    const char4 x = as_char4(a);
+    const char4 y = as_char4(b);
+    return x.s0 * y.s0 + x.s1 * y.s1 + x.s2 * y.s2 + x.s3 * y.s3;
+#endif
+}
+
+// Kernel for int8 matrix multiply with int32 accumulation: out[m][n] = scale_a[m] * scale_b[n] * sum_k a[m][k] * b[n][k].
+// a is M x K and b is N x K (B transposed), both row-major int8 packed four to a uint, so k4 = K / 4.
+__kernel void gemm_int8_ocl(const int M, const int N, const int k4, __global const uint *a, __global const uint *b,
+                            __global const float *scale_a, __global const float *scale_b, __global float *out) {
+    __local uint tile_a[GEMM_TILE][GEMM_TILE];
+    __local uint tile_b[GEMM_TILE][GEMM_TILE];
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int n = get_global_id(0);
+    const int m = get_global_id(1);
+    const int tile_m = get_group_id(1) * GEMM_TILE;
+    const int tile_n = get_group_id(0) * GEMM_TILE;
+    int acc = 0;
+
+    for (int k0 = 0; k0 < k4; k0 += GEMM_TILE) {
+        // Row ly of each tile is loaded by the work-items of row ly, zero-padded at the edges
+        const int k = k0 + lx;
+        tile_a[ly][lx] = tile_m + ly < M && k < k4 ? a[(tile_m + ly) * k4 + k] : 0;
+        tile_b[ly][lx] = tile_n + ly < N && k < k4 ? b[(tile_n + ly) * k4 + k] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int t = 0; t < GEMM_TILE; t++) {
+            acc += dot_int8x4(tile_a[ly][t], tile_b[lx][t]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (m < M && n < N) {
+        out[m * N + n] = (float)acc * scale_a[m] * scale_b[n];
+    }
+}
+
+#define GEMV_ROWS 4 // Rows reduced by each work-group of gemv_rows_ocl
+
+// Kernel for y = A x with row-major A (row r starts at r * ld). Each work-group reduces GEMV_ROWS rows together:
+// work-items stride across the columns and reuse each x value they load for all of the group's rows, then the
+// partial sums of every row are reduced in local memory (tmp holds GEMV_ROWS * local size floats).
+__kernel void gemv_rows_ocl(const int rows, const int cols, const int ld, __global const float *a,
+                            __global const float *x, __global float *y, __local float *tmp) {
+    const int lid = get_local_id(0);
+    const int lsize = get_local_size(0);
+    const int row0 = get_group_id(0) * GEMV_ROWS;
+    float acc[GEMV_ROWS];
+    for (int r = 0; r < GEMV_ROWS; r++) {
+        acc[r] = 0.0f;
+    }
+
+    for (int c = lid; c < cols; c += lsize) {
+        const float xc = x[c];
+        for (int r = 0; r < GEMV_ROWS; r++) {
+            if (row0 + r < rows) {
+                acc[r] += a[(row0 + r) * ld + c] * xc;
+            }
+        }
+    }
+
+    for (int r = 0; r < GEMV_ROWS; r++) {
+        tmp[r * lsize + lid] = acc[r];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int offset = lsize / 2; offset > 0; offset /= 2) {
+        if (lid < offset) {
+            for (int r = 0; r < GEMV_ROWS; r++) {
+                tmp[r * lsize + lid] += tmp[r * lsize + lid + offset];
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid < GEMV_ROWS && row0 + lid < rows) {
+        y[row0 + lid] = tmp[lid * lsize];
+    }
+}
+
+// Kernel for y = A x with column-major A (column c starts at c * ld). Each work-item owns one row, so the reads of
+// a column are coalesced, and x is staged in local memory (x_local holds local size floats) one chunk at a time.
+__kernel void gemv_cols_ocl(const int rows, const int cols, const int ld, __global const float *a,
+                            __global const float *x, __global float *y, __local float *x_local) {
+    const int row = get_global_id(0);
+    const int lid = get_local_id(0);
+    const int lsize = get_local_size(0);
+    float acc = 0.0f;
+
+    for (int c0 = 0; c0 < cols; c0 += lsize) {
+        const int n = min(lsize, cols - c0);
+        if (lid < n) {
+            x_local[lid] = x[c0 + lid];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (row < rows) {
+            for (int j = 0; j < n; j++) {
+                acc += a[(c0 + j) * ld + row] * x_local[j];
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (row < rows) {
+        y[row] = acc;
+    }
+}
+
+// Kernel for the rank-1 update a += alpha * u v^T, row-major with leading dimension ld
+__kernel void ger_ocl(const int rows, const int cols, const int ld, const float alpha, __global const float *u,
+                      __global const float *v, __global float *a) {
+    const int col = get_global_id(0);
+    const int row = get_global_id(1);
+    if (row < rows && col < cols) {
+        a[row * ld + col] += alpha * u[row] * v[col];
+    }
+}
+
+// Kernel for a matrix add fused with a rank-1 update: out = a + b + alpha * u v^T, row-major with leading dimension ld
+__kernel void matrix_add_ger_ocl(const int rows, const int cols, const int ld, const float alpha, __global const float *u,
+                                 __global const float *v, __global const float *a, __global const float *b,
+                                 __global float *out) {
+    const int col = get_global_id(0);
+    const int row = get_global_id(1);
+    if (row < rows && col < cols) {
+        const int i = row * ld + col;
+        out[i] = a[i] + b[i] + alpha * u[row] * v[col];
+    }
+}
+
+#define REDUCE_SUM_OP(x, y) ((x) + (y))
+#define REDUCE_MAX_OP(x, y) fmax((x), (y))
+#define LOAD_ONE(i) a[i]
+#define LOAD_ADD(i) (a[i] + b[i])
+
+// Axis reduction kernels for one operation over a row-major matrix with leading dimension ld; the host passes
+// column-major matrices transposed. NAME_rows gives one result per row, one work-group per row with a tree reduction
+// in local memory (tmp holds local size floats). NAME_cols gives one result per column, one work-item per column so
+// the reads of each row are coalesced. With LOAD_ADD the kernels reduce a + b without writing the sum anywhere;
+// with LOAD_ONE b is unused.
+#define AXIS_REDUCE_KERNELS(NAME, OP, IDENTITY, LOAD)                                                           \
+__kernel void NAME##_rows(const int rows, const int cols, const int ld, __global const float *a,              \
+                          __global const float *b, __global float *out, __local float *tmp) {                 \
+    const int row = get_group_id(0);                                                                           \
+    const int lid = get_local_id(0);                                                                           \
+    const int lsize = get_local_size(0);                                                                       \
+    float acc = IDENTITY;                                                                                      \
+    for (int c = lid; c < cols; c += lsize) {                                                                  \
+        acc = OP(acc, LOAD(row * ld + c));                                                                     \
+    }                                                                                                          \
+    tmp[lid] = acc;                                                                                            \
+    barrier(CLK_LOCAL_MEM_FENCE);                                                                              \
+    for (int offset = lsize / 2; offset > 0; offset /= 2) {                                                    \
+        if (lid < offset) {                                                                                    \
+            tmp[lid] = OP(tmp[lid], tmp[lid + offset]);                                                        \
+        }                                                                                                      \
+        barrier(CLK_LOCAL_MEM_FENCE);                                                                          \
+    }                                                                                                          \
+    if (lid == 0) {                                                                                            \
+        out[row] = tmp[0];                                                                                     \
+    }                                                                                                          \
+}                                                                                                              \
+                                                                                                               \
+__kernel void NAME##_cols(const int rows, const int cols, const int ld, __global const float *a,              \
+                          __global const float *b, __global float *out) {                                     \
+    const int col = get_global_id(0);                                                                          \
+    if (col < cols) {                                                                                          \
+        float acc = IDENTITY;                                                                                  \
+        for (int r = 0; r < rows; r++) {                                                                       \
+            acc = OP(acc, LOAD(r * ld + col));                                                                 \
+        }                                                                                                      \
+        out[col] = acc;                                                                                        \
+    }                                                                                                          \
+}
+
+AXIS_REDUCE_KERNELS(sum, REDUCE_SUM_OP, 0.0f, LOAD_ONE)
+AXIS_REDUCE_KERNELS(max, REDUCE_MAX_OP, -INFINITY, LOAD_ONE)
+AXIS_REDUCE_KERNELS(add_sum, REDUCE_SUM_OP, 0.0f, LOAD_ADD)
+AXIS_REDUCE_KERNELS(add_max, REDUCE_MAX_OP, -INFINITY, LOAD_ADD)
+
+// Elementwise exp, log, sqrt and sigmoid in three precision tiers: full-precision built-ins, native_* (device
+// defined accuracy, usually the fastest) and half_* (at least 10 bits of accuracy).
+#define SIGMOID_FULL(x) (1.0f / (1.0f + exp(-(x))))
+#define SIGMOID_NATIVE(x) native_recip(1.0f + native_exp(-(x)))
+#define SIGMOID_HALF(x) half_recip(1.0f + half_exp(-(x)))
+
+#define ELEMENTWISE_KERNEL(NAME, F)                                                                           \
+__kernel void NAME(const int size, __global const float *in, __global float *out) {                          \
+    const int i = get_global_id(0);                                                                            \
+    if (i < size) {                                                                                            \
+        out[i] = F(in[i]);                                                                                     \
+    }                                                                                                          \
+}
+
+ELEMENTWISE_KERNEL(exp_full, exp)
+ELEMENTWISE_KERNEL(exp_native, native_exp)
+ELEMENTWISE_KERNEL(exp_half, half_exp)
+ELEMENTWISE_KERNEL(log_full, log)
+ELEMENTWISE_KERNEL(log_native, native_log)
+ELEMENTWISE_KERNEL(log_half, half_log)
+ELEMENTWISE_KERNEL(sqrt_full, sqrt)
+ELEMENTWISE_KERNEL(sqrt_native, native_sqrt)
+ELEMENTWISE_KERNEL(sqrt_half, half_sqrt)
+ELEMENTWISE_KERNEL(sigmoid_full, SIGMOID_FULL)
+ELEMENTWISE_KERNEL(sigmoid_native, SIGMOID_NATIVE)
+ELEMENTWISE_KERNEL(sigmoid_half, SIGMOID_HALF)